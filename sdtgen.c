@@ -0,0 +1,447 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice unmodified, this list of conditions, and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Generate synthetic amd64 relocatable objects for exercising and benchmarking
+ * sdtpatch. The output is written directly, without libelf, so that this
+ * program can be built on any host.
+ *
+ * The generated .text consists of nfuncs functions. Probe call sites, other
+ * calls and tail calls to probes are spread evenly over the functions, with
+ * tail calls ending the first njmps functions and the others ending with a
+ * return. Each probe site references one of nnames probe stubs.
+ */
+
+#include <sys/param.h>
+
+#include <elf.h>
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if BYTE_ORDER != LITTLE_ENDIAN
+#error "sdtgen only supports little-endian hosts"
+#endif
+
+#define	AMD64_CALL	0xe8
+#define	AMD64_JMP32	0xe9
+#define	AMD64_RETQ	0xc3
+
+struct buf {
+	uint8_t		*data;
+	size_t		len;
+	size_t		cap;
+};
+
+struct section {
+	Elf64_Shdr	shdr;
+	struct buf	*buf;
+};
+
+static size_t	addsec(struct section *, size_t *, struct buf *, const char *,
+		    size_t, uint32_t, uint64_t, uint64_t);
+static size_t	buf_append(struct buf *, const void *, size_t);
+static size_t	buf_str(struct buf *, const char *, ...);
+static size_t	getnum(const char *, const char *);
+static void	reloc(struct buf *, uint64_t, uint64_t, uint32_t, int64_t);
+static size_t	symbol(struct buf *, struct buf *, const char *, size_t,
+		    uint8_t, uint16_t, uint64_t, uint64_t);
+static void	usage(void);
+
+/* Add a section header, returning the index of the new section. */
+static size_t
+addsec(struct section *secs, size_t *nscns, struct buf *shstrtab,
+    const char *name, size_t num, uint32_t type, uint64_t flags,
+    uint64_t align)
+{
+	struct section *sec;
+
+	sec = &secs[*nscns];
+	memset(sec, 0, sizeof(*sec));
+	sec->shdr.sh_name = buf_str(shstrtab, name, num);
+	sec->shdr.sh_type = type;
+	sec->shdr.sh_flags = flags;
+	sec->shdr.sh_addralign = align;
+	return ((*nscns)++);
+}
+
+static size_t
+buf_append(struct buf *b, const void *data, size_t len)
+{
+	size_t off;
+
+	if (b->len + len > b->cap) {
+		if (b->cap == 0)
+			b->cap = 4096;
+		while (b->len + len > b->cap)
+			b->cap *= 2;
+		if ((b->data = realloc(b->data, b->cap)) == NULL)
+			err(1, "realloc");
+	}
+	off = b->len;
+	if (data != NULL)
+		memcpy(b->data + off, data, len);
+	else
+		memset(b->data + off, 0, len);
+	b->len += len;
+	return (off);
+}
+
+/* Append a formatted, NUL-terminated string, returning its offset. */
+static size_t
+buf_str(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	size_t off;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		err(1, "vsnprintf");
+	off = buf_append(b, NULL, len + 1);
+	va_start(ap, fmt);
+	(void)vsnprintf((char *)b->data + off, len + 1, fmt, ap);
+	va_end(ap);
+	return (off);
+}
+
+static size_t
+getnum(const char *arg, const char *what)
+{
+	char *end;
+	unsigned long long val;
+
+	errno = 0;
+	val = strtoull(arg, &end, 10);
+	if (errno != 0 || *end != '\0' || end == arg || val > SIZE_MAX)
+		errx(1, "invalid %s '%s'", what, arg);
+	return ((size_t)val);
+}
+
+static void
+reloc(struct buf *b, uint64_t offset, uint64_t symndx, uint32_t type,
+    int64_t addend)
+{
+	Elf64_Rela rela;
+
+	rela.r_offset = offset;
+	rela.r_info = ELF64_R_INFO(symndx, type);
+	rela.r_addend = addend;
+	(void)buf_append(b, &rela, sizeof(rela));
+}
+
+/* Add a symbol, returning its index. */
+static size_t
+symbol(struct buf *symtab, struct buf *strtab, const char *name, size_t num,
+    uint8_t info, uint16_t shndx, uint64_t value, uint64_t size)
+{
+	Elf64_Sym sym;
+
+	memset(&sym, 0, sizeof(sym));
+	if (name != NULL)
+		sym.st_name = buf_str(strtab, "%s%zu", name, num);
+	sym.st_info = info;
+	sym.st_shndx = shndx;
+	sym.st_value = value;
+	sym.st_size = size;
+	return (buf_append(symtab, &sym, sizeof(sym)) / sizeof(sym));
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "usage: sdtgen [-DR] [-f funcs] [-j jmps] [-n names] [-p probes]\n"
+	    "\t[-r relocs] [-S sections] [-s symbols] -o <obj>\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct buf text, reltext, data, reldata, symtab, strtab, shstrtab;
+	struct buf *extra;
+	struct section *secs;
+	Elf64_Ehdr ehdr;
+	Elf64_Sym *sym;
+	FILE *fp;
+	const char *out;
+	uint64_t off;
+	size_t calls, i, j, nfuncs, njmps, nnames, nprobes, nrelocs, nscns,
+	    nsecs, nsyms, site, start;
+	size_t datandx, firstext, firstfunc, firstname, ndx, shstrndx, symndx,
+	    textndx;
+	uint8_t insn[5];
+	int ch;
+	bool nodata, reldatasec;
+
+	nfuncs = 10;
+	njmps = 0;
+	nnames = 16;
+	nprobes = 10;
+	nrelocs = 0;
+	nsecs = 0;
+	nsyms = 0;
+	nodata = reldatasec = false;
+	out = NULL;
+	while ((ch = getopt(argc, argv, "DRS:f:j:n:o:p:r:s:")) != -1) {
+		switch (ch) {
+		case 'D':
+			nodata = true;
+			break;
+		case 'R':
+			reldatasec = true;
+			break;
+		case 'S':
+			nsecs = getnum(optarg, "section count");
+			break;
+		case 'f':
+			nfuncs = getnum(optarg, "function count");
+			break;
+		case 'j':
+			njmps = getnum(optarg, "jump count");
+			break;
+		case 'n':
+			nnames = getnum(optarg, "probe name count");
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'p':
+			nprobes = getnum(optarg, "probe count");
+			break;
+		case 'r':
+			nrelocs = getnum(optarg, "relocation count");
+			break;
+		case 's':
+			nsyms = getnum(optarg, "symbol count");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind || out == NULL)
+		usage();
+	if (nfuncs == 0)
+		errx(1, "at least one function is required");
+	if (njmps > nfuncs)
+		errx(1, "at most one tail call per function is supported");
+	if (nnames == 0)
+		nnames = 1;
+	if (nodata && reldatasec)
+		errx(1, "-D and -R are mutually exclusive");
+
+	memset(&text, 0, sizeof(text));
+	memset(&reltext, 0, sizeof(reltext));
+	memset(&data, 0, sizeof(data));
+	memset(&reldata, 0, sizeof(reldata));
+	memset(&symtab, 0, sizeof(symtab));
+	memset(&strtab, 0, sizeof(strtab));
+	memset(&shstrtab, 0, sizeof(shstrtab));
+	(void)buf_append(&strtab, NULL, 1);
+	(void)buf_append(&shstrtab, NULL, 1);
+
+	/* Section headers; sizes and offsets are filled in at the end. */
+	if ((secs = calloc(nsecs + 8, sizeof(*secs))) == NULL ||
+	    (extra = calloc(MAX(nsecs, 1), sizeof(*extra))) == NULL)
+		err(1, "calloc");
+	nscns = 1;
+	textndx = addsec(secs, &nscns, &shstrtab, ".text", 0, SHT_PROGBITS,
+	    SHF_ALLOC | SHF_EXECINSTR, 16);
+	secs[textndx].buf = &text;
+	ndx = addsec(secs, &nscns, &shstrtab, ".rela.text", 0, SHT_RELA,
+	    SHF_INFO_LINK, 8);
+	secs[ndx].shdr.sh_info = textndx;
+	secs[ndx].buf = &reltext;
+	datandx = 0;
+	if (!nodata) {
+		datandx = addsec(secs, &nscns, &shstrtab, ".data", 0,
+		    SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8);
+		secs[datandx].buf = &data;
+	}
+	if (reldatasec) {
+		ndx = addsec(secs, &nscns, &shstrtab, ".rela.data", 0,
+		    SHT_RELA, SHF_INFO_LINK, 8);
+		secs[ndx].shdr.sh_info = datandx;
+		secs[ndx].buf = &reldata;
+	}
+	for (i = 0; i < nsecs; i++) {
+		ndx = addsec(secs, &nscns, &shstrtab, ".rodata.gen%zu", i,
+		    SHT_PROGBITS, SHF_ALLOC, 8);
+		(void)buf_append(&extra[i], NULL, 16);
+		secs[ndx].buf = &extra[i];
+	}
+	symndx = addsec(secs, &nscns, &shstrtab, ".symtab", 0, SHT_SYMTAB, 0,
+	    8);
+	secs[symndx].shdr.sh_entsize = sizeof(Elf64_Sym);
+	secs[symndx].buf = &symtab;
+	ndx = addsec(secs, &nscns, &shstrtab, ".strtab", 0, SHT_STRTAB, 0, 1);
+	secs[symndx].shdr.sh_link = ndx;
+	secs[ndx].buf = &strtab;
+	shstrndx = addsec(secs, &nscns, &shstrtab, ".shstrtab", 0, SHT_STRTAB,
+	    0, 1);
+	secs[shstrndx].buf = &shstrtab;
+	for (i = 1; i < nscns; i++)
+		if (secs[i].shdr.sh_type == SHT_RELA) {
+			secs[i].shdr.sh_link = symndx;
+			secs[i].shdr.sh_entsize = sizeof(Elf64_Rela);
+		}
+	if (nscns >= SHN_LORESERVE)
+		errx(1, "too many sections");
+
+	/*
+	 * Symbols. Locals come first: section symbols for .text and .data,
+	 * then the extra symbols. Then global functions, probe stubs and the
+	 * targets of the other calls.
+	 */
+	(void)symbol(&symtab, &strtab, NULL, 0, 0, SHN_UNDEF, 0, 0);
+	(void)symbol(&symtab, &strtab, NULL, 0,
+	    ELF64_ST_INFO(STB_LOCAL, STT_SECTION), textndx, 0, 0);
+	if (!nodata)
+		(void)symbol(&symtab, &strtab, NULL, 0,
+		    ELF64_ST_INFO(STB_LOCAL, STT_SECTION), datandx, 0, 0);
+	for (i = 0; i < nsyms; i++) {
+		if (nodata)
+			(void)symbol(&symtab, &strtab, "sym_", i,
+			    ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE), textndx, 0,
+			    0);
+		else
+			(void)symbol(&symtab, &strtab, "sym_", i,
+			    ELF64_ST_INFO(STB_LOCAL, STT_OBJECT), datandx,
+			    i * 8, 8);
+	}
+	secs[symndx].shdr.sh_info = symtab.len / sizeof(Elf64_Sym);
+	firstfunc = symtab.len / sizeof(Elf64_Sym);
+	for (i = 0; i < nfuncs; i++)
+		(void)symbol(&symtab, &strtab, "func_", i,
+		    ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), textndx, 0, 0);
+	firstname = symtab.len / sizeof(Elf64_Sym);
+	for (i = 0; i < MIN(nnames, nprobes); i++)
+		(void)symbol(&symtab, &strtab, "__dtrace_sdt_gen__probe", i,
+		    ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF, 0, 0);
+	firstext = symtab.len / sizeof(Elf64_Sym);
+	for (i = 0; i < nrelocs; i++)
+		(void)symbol(&symtab, &strtab, "ext_", i,
+		    ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF, 0, 0);
+
+	/*
+	 * Text. Function i gets the probe calls and other calls whose index
+	 * is congruent to i modulo nfuncs.
+	 */
+	site = 0;
+	calls = nprobes - MIN(njmps, nprobes);
+	for (i = 0; i < nfuncs; i++) {
+		start = text.len;
+		for (j = i; j < calls + nrelocs; j += nfuncs) {
+			insn[0] = AMD64_CALL;
+			memset(&insn[1], 0, 4);
+			off = buf_append(&text, insn, sizeof(insn));
+			if (j < calls)
+				reloc(&reltext, off + 1,
+				    firstname + site++ % nnames,
+				    R_X86_64_PC32, -4);
+			else
+				reloc(&reltext, off + 1,
+				    firstext + j - calls, R_X86_64_PC32, -4);
+		}
+		if (i < njmps && site < nprobes) {
+			insn[0] = AMD64_JMP32;
+			memset(&insn[1], 0, 4);
+			off = buf_append(&text, insn, sizeof(insn));
+			reloc(&reltext, off + 1, firstname + site++ % nnames,
+			    R_X86_64_PC32, -4);
+		} else {
+			insn[0] = AMD64_RETQ;
+			(void)buf_append(&text, insn, 1);
+		}
+
+		sym = (Elf64_Sym *)symtab.data + firstfunc + i;
+		sym->st_value = start;
+		sym->st_size = text.len - start;
+	}
+
+	/* Data, with an optional table of function pointers. */
+	if (!nodata) {
+		(void)buf_append(&data, NULL, MAX(nsyms, 1) * 8);
+		if (reldatasec)
+			for (i = 0; i < nfuncs; i++) {
+				off = buf_append(&data, NULL, 8);
+				reloc(&reldata, off, firstfunc + i,
+				    R_X86_64_64, 0);
+			}
+	}
+
+	/* Lay out the file: headers, section contents, section headers. */
+	off = sizeof(Elf64_Ehdr);
+	for (i = 1; i < nscns; i++) {
+		off = roundup(off, secs[i].shdr.sh_addralign);
+		secs[i].shdr.sh_offset = off;
+		secs[i].shdr.sh_size = secs[i].buf->len;
+		off += secs[i].buf->len;
+	}
+	off = roundup(off, 8);
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_FREEBSD;
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_shoff = off;
+	ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = nscns;
+	ehdr.e_shstrndx = shstrndx;
+
+	if ((fp = fopen(out, "w")) == NULL)
+		err(1, "failed to open %s", out);
+	(void)fwrite(&ehdr, sizeof(ehdr), 1, fp);
+	for (i = 1; i < nscns; i++) {
+		while ((uint64_t)ftello(fp) < secs[i].shdr.sh_offset)
+			(void)fputc(0, fp);
+		(void)fwrite(secs[i].buf->data, 1, secs[i].buf->len, fp);
+	}
+	while ((uint64_t)ftello(fp) < ehdr.e_shoff)
+		(void)fputc(0, fp);
+	for (i = 0; i < nscns; i++)
+		(void)fwrite(&secs[i].shdr, sizeof(Elf64_Shdr), 1, fp);
+	if (ferror(fp) || fclose(fp) != 0)
+		err(1, "failed to write %s", out);
+
+	return (0);
+}
@@ -27,857 +27,4400 @@
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD$");
 
-#include <sys/types.h>
+#include <sys/param.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/sdt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
-#include <assert.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <libutil.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
 #include <gelf.h>
 #include <libelf.h>
 
 #define	ELF_ERR()	(elf_errmsg(elf_errno()))
-#define	LOG(...) do {					\
-	if (g_verbose)					\
-		warnx(__VA_ARGS__);			\
+#define	LOG(ctx, ...) do {				\
+	if ((ctx)->verbose)				\
+		objwarnx((ctx), __VA_ARGS__);		\
+} while (0)
+
+/*
+ * Call a function which takes the ELF class as its last argument with a
+ * constant class. Such functions are always inlined, so this instantiates them
+ * for each class and lets the compiler reduce the class-dependent accessors
+ * they use to direct loads of the Elf32_ or Elf64_ structure fields.
+ */
+#define	CLASS_DISPATCH(ctx, fn, ...) do {				\
+	switch ((ctx)->class) {						\
+	case ELFCLASS32:						\
+		fn(__VA_ARGS__, ELFCLASS32);				\
+		break;							\
+	case ELFCLASS64:						\
+		fn(__VA_ARGS__, ELFCLASS64);				\
+		break;							\
+	default:							\
+		objerrx((ctx), "unexpected ELF class %d",		\
+		    (ctx)->class);					\
+	}								\
 } while (0)
 
 #define	AMD64_CALL	0xe8
 #define	AMD64_JMP32	0xe9
 #define	AMD64_NOP	0x90
 #define	AMD64_RETQ	0xc3
+#define	AMD64_SITESZ	5	/* size of a call or tail call to a probe */
+
+/*
+ * Encodings used to disable amd64 probe sites, selected with --nops. A call is
+ * replaced with NOPs, and a tail call with a return padded with NOPs which are
+ * never executed. The default is the original encoding, with five one-byte
+ * NOPs per site and the return of a tail call in its second byte, which is the
+ * layout expected by code that enables the sites. "p6" uses the long NOP
+ * recommended by Intel and AMD, so that each disabled site is a single
+ * instruction, and "k8" uses NOPs made of operand size prefixes, as recommended
+ * for older AMD CPUs; both put the return of a tail call in its first byte.
+ */
+struct nop_style {
+	const char	*name;
+	uint8_t		call[AMD64_SITESZ];
+	uint8_t		jmp[AMD64_SITESZ];
+};
+
+static const struct nop_style nop_styles[] = {
+	{ "single",
+	    { AMD64_NOP, AMD64_NOP, AMD64_NOP, AMD64_NOP, AMD64_NOP },
+	    { AMD64_NOP, AMD64_RETQ, AMD64_NOP, AMD64_NOP, AMD64_NOP } },
+	{ "p6",
+	    { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	    { AMD64_RETQ, 0x0f, 0x1f, 0x40, 0x00 } },
+	{ "k8",
+	    { 0x66, 0x66, 0x90, 0x66, 0x90 },
+	    { AMD64_RETQ, 0x66, 0x66, 0x66, 0x90 } },
+};
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define	ELFDATA_HOST	ELFDATA2LSB
+#else
+#define	ELFDATA_HOST	ELFDATA2MSB
+#endif
 
 static const char probe_prefix[] = "__dtrace_sdt_";
 static const char sdtobj_prefix[] = "sdt_";
 static const char sdtinst_prefix[] = "sdt$";
 
-static const char *g_currobj;
-static bool g_verbose = false;
+/* Job slots whose jobserver tokens are returned at exit, see jobslots_exit(). */
+static struct jobslots *exitslots;
 
-struct probe_instance {
+/*
+ * Positions of the two characters of probe_prefix that are used to find
+ * candidate matches when scanning string tables. Underscores are common in
+ * kernel symbol names, so avoid them.
+ */
+#define	PROBE_PREFIX_C1	2	/* 'd' */
+#define	PROBE_PREFIX_C2	9	/* 's' */
+
+/*
+ * Result cache. Entries are files in a single directory, named after a hash of
+ * the input object and its size. An entry either records that the object needs
+ * no changes, or holds the patched object. The names of the instance symbols
+ * added to a patched object include the object's ftok(3) key, so that key is
+ * also part of the name of the latter kind of entry, along with the NOP
+ * encoding used. Entries are evicted in least recently used order, using the
+ * modification time of the entry, which is updated on every hit.
+ */
+struct cache {
+	const char	*dir;
+	int		dirfd;
+	uint64_t	maxsize;
+	pthread_mutex_t	lock;
+	uintmax_t	hits;
+	uintmax_t	misses;
+	uintmax_t	evictions;
+};
+
+struct cache_hdr {
+	char		ch_magic[4];
+	uint32_t	ch_version;
+	uint32_t	ch_kind;
+	uint32_t	ch_pad;
+	uint64_t	ch_check;	/* second hash of the input */
+	uint64_t	ch_size;	/* size of the patched object */
+};
+
+#define	CACHE_MAGIC	"SDTC"
+#define	CACHE_VERSION	1
+#define	CACHE_UNCHANGED	0
+#define	CACHE_PATCHED	1
+
+#define	CACHE_DEFAULT_SIZE	(512 * 1024 * 1024)
+
+/* Long-only options. */
+#define	OPT_CLIENT	(CHAR_MAX + 1)
+#define	OPT_SERVE	(CHAR_MAX + 2)
+#define	OPT_STATS	(CHAR_MAX + 3)
+#define	OPT_PERF	(CHAR_MAX + 4)
+#define	OPT_TRACE	(CHAR_MAX + 5)
+#define	OPT_NOPS	(CHAR_MAX + 6)
+#define	OPT_READAHEAD	(CHAR_MAX + 7)
+#define	OPT_URING	(CHAR_MAX + 8)
+
+struct cache_ent {
+	char		*name;
+	off_t		size;
+	struct timespec	mtime;
+};
+
+/*
+ * A bump allocator for memory that lives as long as the object being
+ * processed. Small allocations are carved out of shared chunks; large ones get
+ * a chunk of their own, so that they can be grown with realloc(3). Everything
+ * is released at once by arena_free(), which must not be called before
+ * elf_end() since libelf refers to the section builder buffers.
+ */
+struct arena_chunk {
+	LIST_ENTRY(arena_chunk) link;
+	size_t		size;
+	size_t		used;
+};
+
+LIST_HEAD(arena, arena_chunk);
+
+#define	ARENA_ALIGN	16
+#define	ARENA_CHUNKSZ	(256 * 1024)
+#define	ARENA_LARGE	(ARENA_CHUNKSZ / 8)
+#define	ARENA_HDRSZ	roundup2(sizeof(struct arena_chunk), ARENA_ALIGN)
+
+/*
+ * Symbol name index, mapping names to symbol table indices. This is an open
+ * addressing hash table whose size is always a power of two. Names are not
+ * copied, so they must outlive the table: they point into the object's string
+ * table or are allocated from the object's arena.
+ */
+struct symname_ent {
+	const char	*name;
+	uint64_t	ndx;
+	uint32_t	hash;
+};
+
+struct symname_tab {
+	struct symname_ent *ents;
+	size_t		size;
+	size_t		count;
+};
+
+/*
+ * Function symbols defined in a given section, sorted by start address.
+ * maxend is the largest end address of any interval at or before a given
+ * position in the table, which bounds the backwards search needed to handle
+ * overlapping intervals.
+ */
+struct func_interval {
+	uint64_t	start;
+	uint64_t	end;
+	uint64_t	maxend;
+	uint64_t	symndx;
+};
+
+struct functab {
+	size_t		shndx;
+	struct func_interval *ivs;
+	size_t		count;
+	SLIST_ENTRY(functab) next;
+};
+
+SLIST_HEAD(functab_list, functab);
+
+/*
+ * Accumulates the data appended to a section so that it can be written out as
+ * a single contiguous block once processing of the object is complete. base is
+ * the size of the section before anything was appended, so offsets returned by
+ * secbuf_append() are relative to the start of the section.
+ */
+struct secbuf {
+	struct arena	*arena;
+	size_t		ndx;
+	size_t		base;
+	uint8_t		*buf;
+	size_t		len;
+	size_t		cap;
+};
+
+/*
+ * Statistics collected for each object when --stats or --trace is specified.
+ * Time is charged to one phase at a time. process_obj() moves through the
+ * phases with stats_phase(), which also records the span of each phase for
+ * --trace; nested phases, such as symbol lookups done while scanning
+ * relocations, are switched to and from with stats_nest(), so the times are
+ * exclusive. CPU time is that of the thread processing the object.
+ */
+#define	PHASE_OPEN	0	/* open, prefilter, cache lookup, obj_open() */
+#define	PHASE_SCAN	1	/* relocation scan */
+#define	PHASE_SYMBOLS	2	/* symbol and function lookups */
+#define	PHASE_RECORD	3	/* record_instance() and section builders */
+#define	PHASE_WRITE	4	/* obj_write() */
+#define	PHASE_OTHER	5
+#define	NPHASES		6
+
+#define	RESULT_SKIPPED	0	/* rejected by probe_prefilter() */
+#define	RESULT_CACHED	1
+#define	RESULT_NOPROBES	2
+#define	RESULT_PATCHED	3
+#define	RESULT_FAILED	4
+#define	NRESULTS	5
+
+static const char *phase_names[NPHASES] = {
+	"open", "scan", "symbols", "record", "write", "other"
+};
+static const char *result_names[NRESULTS] = {
+	"skipped", "cached", "no probes", "patched", "failed"
+};
+
+#define	NSECBUFS	7	/* section builders in struct objctx */
+
+/*
+ * Hardware counters read for each phase with --perf-counters. They form a
+ * single group, so that they are scheduled onto the PMU together.
+ */
+#define	COUNTER_CYCLES	0
+#define	COUNTER_INSNS	1
+#define	COUNTER_CMISS	2
+#define	COUNTER_BMISS	3
+#define	NCOUNTERS	4
+
+struct objstats {
+	uint64_t	wall[NPHASES];	/* nanoseconds */
+	uint64_t	cpu[NPHASES];
+	uint64_t	counters[NPHASES][NCOUNTERS];
+	uint64_t	lastwall;
+	uint64_t	lastcpu;
+	uint64_t	lastcounters[NCOUNTERS];
+	bool		hwcounters;	/* counters were read */
+	uint64_t	spanbeg[NPHASES];
+	uint64_t	spanend[NPHASES];
+	off_t		size;
+	int		phase;
+	int		result;
+	uint64_t	relocs;		/* relocations examined */
+	uint64_t	probes;		/* probe sites patched */
+	uint64_t	appended[NSECBUFS];
+};
+
+/*
+ * A distinct probe called from the object. Probe names are interned as
+ * relocations are scanned, so that the probe object symbol (objndx) is looked
+ * up or added once per probe rather than once per call site.
+ */
+struct probe {
 	const char	*symname;
+	uint64_t	objndx;
+	bool		resolved;
+};
+
+/*
+ * A probe call site: the probe, by index in the object's probe table, and the
+ * function containing the site, along with the site's offset in that
+ * function. Instances are stored in an array in the order in which they were
+ * found.
+ */
+struct probe_instance {
+	size_t		probe;
 	uint64_t	symndx;
 	uint64_t	offset;
-	SLIST_ENTRY(probe_instance) next;
 };
 
-SLIST_HEAD(probe_list, probe_instance);
+/*
+ * A section of the object being processed, indexed by section number. shdr is
+ * a working copy of the section header; it is pushed to the output file when
+ * the object is written. data points to the section contents, which live either
+ * in libelf's buffers or in a private mapping of the file, and may be modified
+ * in place, in which case the modified range is recorded so that only those
+ * bytes need to be written. name and relndx are part of the section directory
+ * built by scndir_init() when the object is opened.
+ */
+struct objscn {
+	GElf_Shdr	shdr;
+	const char	*name;		/* cached by get_section_name() */
+	size_t		relndx;		/* relocation section for this section */
+	uint8_t		*data;
+	size_t		datasz;
+	struct secbuf	*sb;		/* appended data, if any */
+	Elf_Scn		*scn;		/* libelf backend only */
+	Elf_Data	*edata;		/* libelf backend only */
+	size_t		dirtylo;
+	size_t		dirtyhi;
+	bool		isnew;
+};
+
+/*
+ * Per-object state. Each object is processed by exactly one thread, so nothing
+ * here needs locking. When running with multiple workers, diagnostics are
+ * buffered in diag and emitted by the main thread in input order.
+ *
+ * Errors are normally fatal. If recover is set, as it is for objects processed
+ * by worker threads, an error instead abandons the object: control returns to
+ * process_obj() through errjmp, which releases the object's resources and sets
+ * failed.
+ *
+ * Objects are accessed either through libelf (e != NULL), or by the native
+ * backend, which maps the file and only writes back what was changed. The
+ * latter handles ELF64 objects in the host byte order.
+ */
+struct objctx {
+	const char	*path;
+	bool		verbose;
+	bool		uselibelf;
+	bool		recover;
+	bool		atomic;		/* replace the object by renaming */
+	bool		keeptimes;	/* preserve access and modification times */
+	const struct nop_style *nops;
+	u_int		readahead;	/* objects to read ahead */
+	bool		useuring;	/* see uring_open() */
+	bool		dostats;
+	bool		doperf;
+	struct objstats	stats;
+	int		perffds[NCOUNTERS];
+	u_int		worker;		/* worker thread number, from 1 */
+	struct cache	*cache;
+	struct jobslots	*slots;		/* NULL unless -j was specified */
+	struct relshard	*shard;		/* see reloc_shards() */
+	struct arena	arena;		/* released once the object is closed */
+	jmp_buf		errjmp;
+	bool		failed;
+	int		fd;
+	int		outfd;		/* see obj_write_begin() */
+	struct uring	*ring;		/* NULL unless --io-uring was given */
+	bool		prefiltered;	/* see uring_prefilter() */
+	bool		maybeprobes;
+	struct uring_write *writes;	/* see uring_pwrite() */
+	size_t		nwrites;
+	char		*tmppath;
+	char		*target;	/* file replaced by tmppath */
+	struct stat	sb;		/* input file status */
+	Elf		*e;
+	uint8_t		*map;
+	size_t		mapsz;
+	GElf_Ehdr	ehdr;
+	int		class;
+	struct objscn	*scns;
+	size_t		nscns;
+	size_t		scncap;
+	size_t		shstrndx;
+	size_t		*relscns;	/* input relocation sections */
+	size_t		nrelscns;
+	size_t		symtabndx;
+	struct symname_tab symnames;
+	struct functab_list functabs;
+	struct secbuf	shstrbuf;	/* section header string table */
+	struct secbuf	strbuf;		/* symbol string table */
+	struct secbuf	symbuf;		/* symbol table */
+	struct secbuf	databuf;	/* .data */
+	struct secbuf	datarelbuf;	/* .data relocations */
+	struct secbuf	instbuf;	/* instance linker set */
+	struct secbuf	instrelbuf;	/* instance linker set relocations */
+	uint64_t	*probemap;	/* see probemap_get() */
+	size_t		probemapndx;
+	struct probe	*probes;
+	size_t		nprobes;
+	size_t		probecap;
+	struct symname_tab probenames;
+	struct probe_instance *insts;
+	size_t		ninsts;
+	size_t		instcap;
+	long		key;		/* see obj_key() */
+	bool		haskey;
+	FILE		*diag;
+	char		*diagbuf;
+	size_t		diaglen;
+	off_t		size;
+	uint64_t	hash;		/* input hashes, for the result cache */
+	uint64_t	check;
+	off_t		hashsize;
+	bool		done;
+};
+
+/*
+ * Work queue shared by the worker threads. Objects are handed out largest
+ * first; completion is signalled so that the main thread can emit diagnostics
+ * in the order in which the objects were specified.
+ */
+struct workq {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	struct objctx	*objs;
+	struct objctx	**order;
+	size_t		nobjs;
+	size_t		next;
+	size_t		advised;	/* objects read ahead */
+	pthread_t	*tids;		/* threads started */
+	size_t		ntids;
+	u_int		running;	/* workers running */
+	u_int		taken;		/* slots taken for workers */
+	u_int		maxworkers;
+	size_t		batch;		/* see uring_batch() */
+	bool		*lanes;		/* worker numbers in use */
+	struct jobslots	*slots;
+};
+
+/*
+ * Job slots, which limit the number of threads processing objects to the
+ * number given with -j. The main thread and each worker thread hold a slot,
+ * the main thread lending its own to the workers while it waits for them.
+ * Slots left over, for example once fewer objects than workers remain, are
+ * used to scan large relocation sections in parallel. When run by GNU make
+ * with a jobserver, each slot other than the main thread's also needs a token
+ * from the jobserver, which is written back when the slot is returned. The lock
+ * is never held across jobserver I/O, which does not block.
+ */
+struct jobslots {
+	pthread_mutex_t	lock;
+	u_int		avail;		/* slots which may still be taken */
+	int		rfd;		/* jobserver, or -1 */
+	int		wfd;
+	char		*tokens;	/* tokens read from the jobserver */
+	u_int		ntokens;
+};
+
+/*
+ * A range of a large relocation section, scanned by its own thread using a
+ * private copy of the object's context. Probes and instances are collected
+ * there, and the ranges modified in the relocation and target sections are
+ * tracked, until they are merged into the object's context.
+ */
+struct relshard {
+	struct objctx	ctx;
+	pthread_t	tid;
+	size_t		relndx;
+	size_t		symndx;
+	size_t		targndx;
+	const uint64_t	*map;
+	size_t		first;		/* first relocation */
+	size_t		last;		/* last relocation + 1 */
+	size_t		dirtylo[2];	/* relocation and target section */
+	size_t		dirtyhi[2];
+	bool		failed;
+	char		errmsg[256];
+};
+
+/*
+ * Relocation sections are scanned in parallel only if they have at least this
+ * many relocations per shard.
+ */
+#define	RELOC_SHARDSZ	65536
+
+/*
+ * An io_uring instance, used by a single thread to batch the system calls made
+ * for several objects. Each request stores its result in an int given when it
+ * is queued.
+ */
+#ifdef __linux__
+struct uring {
+	int		fd;
+	void		*sqmap;
+	void		*cqmap;
+	struct io_uring_sqe *sqes;
+	size_t		sqmapsz;
+	size_t		cqmapsz;
+	size_t		sqesz;
+	u_int		*sqtail;
+	u_int		*sqmask;
+	u_int		*sqarray;
+	u_int		*cqhead;
+	u_int		*cqtail;
+	u_int		*cqmask;
+	struct io_uring_cqe *cqes;
+	u_int		entries;
+	u_int		tail;		/* next request */
+	u_int		subtail;	/* first request not yet submitted */
+	u_int		pending;	/* requests not yet completed */
+	int		error;		/* if set, the ring is no longer used */
+};
+
+/* An object being prefiltered by uring_prefilter(). */
+struct uring_pfobj {
+	struct objctx	*ctx;		/* NULL once the object is finished */
+	int		res;
+	int		statres;
+	struct statx	stx;
+	uint8_t		ehdr[sizeof(Elf64_Ehdr)];
+	uint8_t		*shdrs;
+	size_t		shnum;
+	size_t		shentsz;
+	char		*strtab;
+	uint64_t	strsz;
+};
+#endif
+
+/* A write queued on an object's io_uring instance. */
+struct uring_write {
+	const void	*buf;
+	size_t		len;
+	off_t		off;
+	int		res;
+};
+
+#define	URING_ENTRIES	64
+#define	URING_BATCH	32	/* at most, see uring_batch() */
+
+/* A client connection in server mode, handled by its own thread. */
+struct serve_conn {
+	int		s;
+	const struct objctx *proto;
+	u_int		njobs;
+	bool		perobj;
+};
+
+/* Paths of the objects to process, in the order in which they were given. */
+struct pathlist {
+	char		**paths;
+	size_t		count;
+	size_t		cap;
+};
 
-static Elf_Scn *add_section(Elf *, const char *, uint64_t, uint64_t);
-static Elf_Scn *add_reloc_section(Elf *, Elf_Scn *, Elf_Scn *);
-static size_t	append_data(Elf *, Elf_Scn *, const void *, size_t);
-static size_t	expand_section(Elf_Scn *, size_t);
-static Elf_Scn *get_reloc_section(Elf *e, Elf_Scn *, Elf_Scn *);
-static const char *get_section_name(Elf *, Elf_Scn *);
-static void	init_new_sections(Elf *, Elf_Scn *, Elf_Scn **, Elf_Scn **,
+static size_t	add_section(struct objctx *, const char *, uint64_t, uint64_t);
+static size_t	add_reloc_section(struct objctx *, size_t, size_t);
+static void *	arena_alloc(struct arena *, size_t);
+static void	arena_free(struct arena *);
+static void *	arena_realloc(struct arena *, void *, size_t, size_t);
+static char *	arena_strdup(struct arena *, const char *);
+static int	cache_ent_cmp(const void *, const void *);
+static bool	cache_get(struct objctx *, const char *, uint32_t);
+static bool	cache_lookup(struct objctx *);
+static void	cache_name(struct objctx *, char *, size_t, bool);
+static struct cache *cache_open(const char *, uint64_t);
+static void	cache_put(struct cache *, const char *, uint32_t, uint64_t,
+		    const void *, size_t);
+static void	cache_report(struct cache *);
+static void	cache_store(struct objctx *, bool);
+static void	cache_trim(struct cache *);
+static int	client(const char *, const struct pathlist *);
+static void	diag_flush(struct objctx *, void *);
+static void	hash_file(struct objctx *, off_t);
+static struct functab *functab_get(struct objctx *, size_t, size_t);
+static void	functab_scan(struct objctx *, size_t, struct functab *, int);
+static int	func_interval_cmp(const void *, const void *);
+static size_t	get_reloc_section(struct objctx *, size_t, size_t);
+static uint64_t	clock_ns(clockid_t);
+static const char *get_section_name(struct objctx *, size_t);
+static void	init_new_sections(struct objctx *, size_t, size_t);
+static bool	jobserver_get(struct jobslots *, char *);
+static bool	jobserver_open(struct jobslots *);
+static void	jobserver_put(struct jobslots *, char);
+static int	jobserver_reopen(int);
+static void	jobslots_exit(void);
+static void	jobslots_put(struct jobslots *, u_int);
+static u_int	jobslots_take(struct jobslots *, u_int);
+static void	libelf_open(struct objctx *);
+static void	mark_dirty(struct objctx *, size_t, size_t, size_t);
+static bool	native_open(struct objctx *);
+static void	obj_close(struct objctx *);
+static long	obj_key(struct objctx *);
+static int	obj_open(struct objctx *);
+static void	obj_pwrite(struct objctx *, Elf_Type, const void *, size_t,
+		    off_t);
+static void	obj_readahead(const char *);
+static void	obj_write(struct objctx *);
+static void	obj_write_begin(struct objctx *, bool);
+static void	obj_write_end(struct objctx *);
+static const char *objstr(struct objctx *, size_t, size_t);
+static void	objerr(struct objctx *, const char *, ...) __dead2
+		    __printflike(2, 3);
+static void	objerrx(struct objctx *, const char *, ...) __dead2
+		    __printflike(2, 3);
+static void	objverr(struct objctx *, int, const char *, va_list) __dead2
+		    __printflike(3, 0);
+static void	objwarnx(struct objctx *, const char *, ...) __printflike(2, 3);
+static int	objsize_cmp(const void *, const void *);
+static void	pathlist_add(struct pathlist *, const char *);
+static void	pathlist_free(struct pathlist *);
+static void	pathlist_read(struct pathlist *, const char *, int);
+static int	pathlist_readfp(struct pathlist *, FILE *, int);
+static void	perf_close(int *);
+static int	perf_open(int *);
+static bool	perf_read(const int *, uint64_t *);
+static bool	prefilter_ehdr(const void *, ssize_t, uint64_t *, size_t *,
+		    size_t *);
+static int	prefilter_strtab(const uint8_t *, size_t, size_t, size_t,
+		    uint64_t *, uint64_t *);
+static bool	prefix_search(const char *, size_t);
+static size_t	probe_intern(struct objctx *, const char *);
+static bool	probe_prefilter(struct objctx *);
+static const uint64_t *probemap_get(struct objctx *, size_t);
+static void	probemap_scan(struct objctx *, size_t, uint64_t *, int);
+static void	probe_resolve(struct objctx *, struct probe *);
+static int	process_reloc(struct objctx *, size_t, size_t, GElf_Addr,
+		    GElf_Xword *);
+static void	process_reloc_section(struct objctx *, size_t);
+static void	process_obj(struct objctx *);
+static void	pwrite_all(struct objctx *, const void *, size_t, off_t);
+static void	record_instance(struct objctx *,
+		    const struct probe_instance *, size_t);
+static GElf_Rela *reloc_by_index(struct objctx *, size_t, size_t,
+		    GElf_Rela *);
+static size_t	reloc_count(struct objctx *, size_t);
+static void	reloc_scan(struct objctx *, size_t, size_t, size_t,
+		    const uint64_t *, size_t, size_t, int);
+static void *	reloc_shard_run(void *);
+static bool	reloc_shards(struct objctx *, size_t, size_t, size_t,
+		    const uint64_t *, size_t);
+static void	reloc_shards_merge(struct objctx *, struct relshard *,
 		    size_t);
-static int	process_reloc(Elf *, GElf_Ehdr *, GElf_Shdr *, Elf_Scn *,
-		    uint8_t *, GElf_Addr, GElf_Xword *, struct probe_list *);
-static void	process_reloc_section(Elf *, GElf_Ehdr *, GElf_Shdr *,
-		    Elf_Scn *, struct probe_list *);
-static void	process_obj(const char *);
-static void	record_instance(Elf *, GElf_Ehdr *, Elf_Scn *, Elf_Scn *,
-		    Elf_Scn *, Elf_Scn *, const struct probe_instance *, int,
-		    const char *);
-static Elf_Scn *section_by_name(Elf *, const char *);
-static int	symbol_by_name(Elf *, Elf_Scn *, const char *, GElf_Sym *,
+static void	reloc_update(struct objctx *, size_t, size_t,
+		    const GElf_Rela *);
+static void	run_workers(struct objctx *, size_t, u_int,
+		    void (*)(struct objctx *, void *), void *);
+static void	serve(const char *, const struct objctx *, u_int, bool)
+		    __dead2;
+static void *	serve_client(void *);
+static void	serve_reply(struct objctx *, void *);
+static void	sockaddr_init(struct sockaddr_un *, const char *);
+static void	stats_begin(struct objctx *);
+static void	stats_end(struct objctx *);
+static int	stats_nest(struct objctx *, int);
+static void	stats_phase(struct objctx *, int);
+static int	stats_switch(struct objctx *, int, bool);
+static void	stats_report(const struct objctx *, size_t, bool);
+static void	scndir_init(struct objctx *);
+static size_t	secbuf_append(struct secbuf *, const void *, size_t);
+static void	secbuf_finish(struct objctx *, struct secbuf *);
+static void	secbuf_init(struct objctx *, struct secbuf *, size_t, size_t);
+static size_t	section_by_name(struct objctx *, const char *);
+static Elf_Type	section_data_type(const struct objscn *);
+static int	symbol_by_name(struct objctx *, const char *, uint64_t *);
+static int	symbol_by_offset(const struct functab *, uint64_t, uint64_t *,
 		    uint64_t *);
-static int	symbol_by_offset(Elf_Scn *scn, uint64_t offset, GElf_Sym *sym,
-		    uint64_t *ndx);
-static GElf_Sym	*symbol_by_index(Elf_Scn *, int);
+static GElf_Sym	*symbol_by_index(struct objctx *, size_t, uint64_t,
+		    GElf_Sym *);
+static size_t	symbol_count(struct objctx *, size_t);
+static void	symbol_load(const uint8_t *, size_t, GElf_Sym *, int);
+static void	symname_add(struct arena *, struct symname_tab *,
+		    const char *, uint64_t);
+static uint32_t	symname_hash(const char *);
+static void	symname_init(struct objctx *, size_t);
+static void	symname_scan(struct objctx *, size_t, size_t, int);
+static int	symname_lookup(const struct symname_tab *, const char *,
+		    uint64_t *);
+static void	trace_string(FILE *, const char *);
+static void	trace_write(const char *, uint64_t, const struct objctx *,
+		    size_t, u_int);
+static u_int	online_cpus(void);
+static size_t	uring_batch(u_int);
+static void	uring_close(struct uring *);
+static void	uring_discard(struct uring *);
+static void	uring_flush(struct objctx *);
+#ifdef __linux__
+static struct io_uring_sqe *uring_get(struct uring *, int *);
+#endif
+static struct uring *uring_open(u_int);
+static void	uring_prefilter(struct uring *, struct objctx **, size_t);
+static void	uring_pwrite(struct objctx *, const void *, size_t, off_t);
+static int	uring_wait(struct uring *);
 static void	usage(void);
-static int	wordsize(Elf *);
+static int	wordsize(struct objctx *);
+static void *	worker(void *);
+static void	worker_start(struct workq *);
 static void *	xmalloc(size_t);
+static uint64_t	xxh64(const void *, size_t, uint64_t);
+static uint64_t	xxh64_merge(uint64_t, uint64_t);
+static uint64_t	xxh64_round(uint64_t, uint64_t);
 
-static Elf_Scn *
-add_section(Elf *e, const char *name, uint64_t type, uint64_t flags)
+/*
+ * Add a new, empty section to the object, returning its index. The section
+ * header is pushed to the output when the object is written.
+ */
+static size_t
+add_section(struct objctx *ctx, const char *name, uint64_t type,
+    uint64_t flags)
 {
-	GElf_Shdr newshdr;
-	Elf_Scn *newscn, *strscn;
-	size_t off, shdrstrndx;
+	struct objscn *newscn;
+	size_t ndx, off;
 
 	/* First add the section name to the section header string table. */
-	if (elf_getshdrstrndx(e, &shdrstrndx) != 0)
-		errx(1, "elf_getshdrstrndx: %s", ELF_ERR());
-	if ((strscn = elf_getscn(e, shdrstrndx)) == NULL)
-		errx(1, "elf_getscn (shdrstrtab): %s", ELF_ERR());
-
-	off = append_data(e, strscn, name, strlen(name) + 1);
+	off = secbuf_append(&ctx->shstrbuf, name, strlen(name) + 1);
 
 	/* Then create the actual section. */
-	if ((newscn = elf_newscn(e)) == NULL)
-		errx(1, "elf_newscn: %s", ELF_ERR());
-	if (gelf_getshdr(newscn, &newshdr) != &newshdr)
-		errx(1, "gelf_getshdr (%s): %s", name, ELF_ERR());
-
-	newshdr.sh_name = off;
-	newshdr.sh_type = type;
-	newshdr.sh_flags = flags;
-	newshdr.sh_addralign = wordsize(e);
-
-	if (gelf_update_shdr(newscn, &newshdr) == 0)
-		errx(1, "gelf_update_shdr (%s): %s", name, ELF_ERR());
-
-	LOG("added section %s", name);
-
-	return (newscn);
+	if (ctx->nscns == ctx->scncap) {
+		ctx->scncap *= 2;
+		ctx->scns = realloc(ctx->scns,
+		    ctx->scncap * sizeof(*ctx->scns));
+		if (ctx->scns == NULL)
+			err(1, "realloc");
+	}
+	ndx = ctx->nscns++;
+	newscn = &ctx->scns[ndx];
+	memset(newscn, 0, sizeof(*newscn));
+	newscn->isnew = true;
+	newscn->shdr.sh_name = off;
+	newscn->shdr.sh_type = type;
+	newscn->shdr.sh_flags = flags;
+	newscn->shdr.sh_addralign = wordsize(ctx);
+	newscn->name = name;
+
+	LOG(ctx, "added section %s", name);
+
+	return (ndx);
 }
 
 /*
  * Add a new relocation section for the specified section and symbol table.
  */
-static Elf_Scn *
-add_reloc_section(Elf *e, Elf_Scn *scn, Elf_Scn *symscn)
+static size_t
+add_reloc_section(struct objctx *ctx, size_t shndx, size_t symndx)
 {
-	GElf_Shdr relshdr;
-	Elf_Scn *relscn;
+	struct objscn *relscn;
 	const char *scnname;
 	char *relscnname;
-	size_t sz, shndx, symndx;
+	size_t sz, relndx;
 
-	scnname = get_section_name(e, scn);
+	scnname = get_section_name(ctx, shndx);
 
 	sz = strlen(".rela") + strlen(scnname) + 1;
-	relscnname = xmalloc(sz);
+	relscnname = arena_alloc(&ctx->arena, sz);
 	(void)strlcpy(relscnname, ".rela", sz);
 	(void)strlcat(relscnname, scnname, sz);
 
-	relscn = add_section(e, relscnname, SHT_RELA, 0);
-	if (gelf_getshdr(relscn, &relshdr) != &relshdr)
-		errx(1, "gelf_getshdr (%s): %s", relscnname, ELF_ERR());
-
-	if ((shndx = elf_ndxscn(scn)) == SHN_UNDEF)
-		errx(1, "elf_ndxscn (%s): %s", scnname, ELF_ERR());
-	if ((symndx = elf_ndxscn(symscn)) == SHN_UNDEF)
-		errx(1, "elf_ndxscn (%s): %s", get_section_name(e, symscn),
-		    ELF_ERR());
+	relndx = add_section(ctx, relscnname, SHT_RELA, 0);
 
-	relshdr.sh_info = shndx;
-	relshdr.sh_link = symndx;
-	if (gelf_update_shdr(relscn, &relshdr) == 0)
-		errx(1, "gelf_update_shdr (%s): %s", relscnname, ELF_ERR());
-	return (relscn);
+	relscn = &ctx->scns[relndx];
+	relscn->shdr.sh_entsize = ctx->class == ELFCLASS32 ?
+	    sizeof(Elf32_Rela) : sizeof(Elf64_Rela);
+	relscn->shdr.sh_info = shndx;
+	relscn->shdr.sh_link = symndx;
+	if (ctx->scns[shndx].relndx == SHN_UNDEF)
+		ctx->scns[shndx].relndx = relndx;
+	return (relndx);
 }
 
 /*
- * Append arbitrary data to an ELF section, returning the original size of the
- * section.
+ * Allocate sz bytes from an arena. The memory is suitably aligned for any of
+ * the structures used here and is released by arena_free().
  */
-static size_t
-append_data(Elf *e, Elf_Scn *scn, const void *data, size_t sz)
+static void *
+arena_alloc(struct arena *arena, size_t sz)
 {
-	GElf_Shdr shdr;
-	Elf_Data *newdata;
-
-	if (gelf_getshdr(scn, &shdr) != &shdr)
-		errx(1, "gelf_getshdr (%s): %s", get_section_name(e, scn),
-		    ELF_ERR());
-	if ((newdata = elf_newdata(scn)) == NULL)
-		errx(1, "elf_newdata (%s): %s", get_section_name(e, scn),
-		    ELF_ERR());
+	struct arena_chunk *chunk;
+	void *p;
+
+	if (sz > SIZE_MAX - ARENA_HDRSZ - ARENA_ALIGN)
+		errx(1, "arena allocation too large");
+	sz = roundup2(sz, ARENA_ALIGN);
+
+	if (sz > ARENA_LARGE) {
+		if ((chunk = malloc(ARENA_HDRSZ + sz)) == NULL)
+			err(1, "malloc");
+		chunk->size = chunk->used = sz;
+		/* Keep the current chunk at the head for small allocations. */
+		if (LIST_EMPTY(arena))
+			LIST_INSERT_HEAD(arena, chunk, link);
+		else
+			LIST_INSERT_AFTER(LIST_FIRST(arena), chunk, link);
+		return ((uint8_t *)chunk + ARENA_HDRSZ);
+	}
 
-	/* No need to set d_off since we let libelf handle the layout. */
-	newdata->d_align = shdr.sh_addralign;
-	newdata->d_buf = xmalloc(sz);
-	newdata->d_size = sz;
-	memcpy(newdata->d_buf, data, sz);
-	return (expand_section(scn, sz));
+	chunk = LIST_FIRST(arena);
+	if (chunk == NULL || chunk->size - chunk->used < sz) {
+		if ((chunk = malloc(ARENA_HDRSZ + ARENA_CHUNKSZ)) == NULL)
+			err(1, "malloc");
+		chunk->size = ARENA_CHUNKSZ;
+		chunk->used = 0;
+		LIST_INSERT_HEAD(arena, chunk, link);
+	}
+	p = (uint8_t *)chunk + ARENA_HDRSZ + chunk->used;
+	chunk->used += sz;
+	return (p);
 }
 
-/* Add sz bytes to the section size, returning the original size. */
-static size_t
-expand_section(Elf_Scn *scn, size_t sz)
+static void
+arena_free(struct arena *arena)
 {
-	GElf_Shdr shdr;
+	struct arena_chunk *chunk;
 
-	if (gelf_getshdr(scn, &shdr) != &shdr)
-		errx(1, "gelf_getshdr: %s", ELF_ERR());
-	shdr.sh_size += sz;
-	if (gelf_update_shdr(scn, &shdr) == 0)
-		errx(1, "gelf_update_shdr: %s", ELF_ERR());
-	return (shdr.sh_size - sz);
+	while ((chunk = LIST_FIRST(arena)) != NULL) {
+		LIST_REMOVE(chunk, link);
+		free(chunk);
+	}
 }
 
 /*
- * Find the relocation section associated with a given ELF section and symbol
- * table.
+ * Resize an allocation of osz bytes to nsz bytes. Large allocations are resized
+ * with realloc(3), and the most recent small allocation is extended in place if
+ * there is room; otherwise the data is copied to a new allocation.
  */
-static Elf_Scn *
-get_reloc_section(Elf *e, Elf_Scn *scn, Elf_Scn *symscn)
+static void *
+arena_realloc(struct arena *arena, void *p, size_t osz, size_t nsz)
+{
+	struct arena_chunk *chunk;
+	uint8_t *end;
+	void *np;
+
+	if (p == NULL)
+		return (arena_alloc(arena, nsz));
+	if (nsz <= osz)
+		return (p);
+	if (nsz > SIZE_MAX - ARENA_HDRSZ - ARENA_ALIGN)
+		errx(1, "arena allocation too large");
+
+	if (roundup2(osz, ARENA_ALIGN) > ARENA_LARGE) {
+		chunk = (struct arena_chunk *)((uint8_t *)p - ARENA_HDRSZ);
+		LIST_REMOVE(chunk, link);
+		nsz = roundup2(nsz, ARENA_ALIGN);
+		if ((chunk = realloc(chunk, ARENA_HDRSZ + nsz)) == NULL)
+			err(1, "realloc");
+		chunk->size = chunk->used = nsz;
+		if (LIST_EMPTY(arena))
+			LIST_INSERT_HEAD(arena, chunk, link);
+		else
+			LIST_INSERT_AFTER(LIST_FIRST(arena), chunk, link);
+		return ((uint8_t *)chunk + ARENA_HDRSZ);
+	}
+
+	chunk = LIST_FIRST(arena);
+	end = (uint8_t *)chunk + ARENA_HDRSZ + chunk->used;
+	osz = roundup2(osz, ARENA_ALIGN);
+	if (roundup2(nsz, ARENA_ALIGN) <= ARENA_LARGE &&
+	    (uint8_t *)p + osz == end &&
+	    chunk->size - chunk->used >= roundup2(nsz, ARENA_ALIGN) - osz) {
+		chunk->used += roundup2(nsz, ARENA_ALIGN) - osz;
+		return (p);
+	}
+
+	np = arena_alloc(arena, nsz);
+	memcpy(np, p, osz);
+	return (np);
+}
+
+static char *
+arena_strdup(struct arena *arena, const char *s)
 {
-	GElf_Shdr shdr;
-	Elf_Scn *relscn;
-	size_t shndx, symshndx;
+	size_t sz;
 
-	if ((shndx = elf_ndxscn(scn)) == SHN_UNDEF)
-		errx(1, "elf_ndxscn (%s): %s", get_section_name(e, scn),
-		    ELF_ERR());
-	if ((symshndx = elf_ndxscn(symscn)) == SHN_UNDEF)
-		errx(1, "elf_ndxscn (%s): %s", get_section_name(e, symscn),
-		    ELF_ERR());
+	sz = strlen(s) + 1;
+	return (memcpy(arena_alloc(arena, sz), s, sz));
+}
 
-	for (relscn = NULL; (relscn = elf_nextscn(e, relscn)) != NULL; ) {
-		if (gelf_getshdr(relscn, &shdr) == NULL)
-			errx(1, "gelf_getshdr (%s): %s",
-			    get_section_name(e, relscn), ELF_ERR());
+static int
+cache_ent_cmp(const void *a, const void *b)
+{
+	const struct cache_ent *ent1, *ent2;
+
+	ent1 = a;
+	ent2 = b;
+	if (ent1->mtime.tv_sec != ent2->mtime.tv_sec)
+		return (ent1->mtime.tv_sec < ent2->mtime.tv_sec ? -1 : 1);
+	if (ent1->mtime.tv_nsec != ent2->mtime.tv_nsec)
+		return (ent1->mtime.tv_nsec < ent2->mtime.tv_nsec ? -1 : 1);
+	return (0);
+}
 
-		if ((shdr.sh_type == SHT_REL || shdr.sh_type == SHT_RELA) &&
-		    shdr.sh_info == shndx && shdr.sh_link == symshndx)
-			return (relscn);
+/*
+ * Try to apply a cache entry to the object, returning true if the entry exists
+ * and is of the expected kind. A patched object is copied over the input.
+ */
+static bool
+cache_get(struct objctx *ctx, const char *name, uint32_t kind)
+{
+	struct cache_hdr hdr;
+	struct stat sb;
+	uint8_t *buf;
+	ssize_t n;
+	int fd;
+	bool hit;
+
+	if ((fd = openat(ctx->cache->dirfd, name, O_RDONLY)) < 0)
+		return (false);
+
+	hit = false;
+	buf = NULL;
+	if (fstat(fd, &sb) != 0 ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.ch_magic, CACHE_MAGIC, sizeof(hdr.ch_magic)) != 0 ||
+	    hdr.ch_version != CACHE_VERSION || hdr.ch_kind != kind ||
+	    hdr.ch_check != ctx->check ||
+	    (uint64_t)sb.st_size != sizeof(hdr) + hdr.ch_size)
+		goto out;
+
+	if (kind == CACHE_PATCHED) {
+		buf = xmalloc(hdr.ch_size);
+		n = pread(fd, buf, hdr.ch_size, sizeof(hdr));
+		if (n < 0 || (uint64_t)n != hdr.ch_size)
+			goto out;
+		obj_write_begin(ctx, false);
+		pwrite_all(ctx, buf, hdr.ch_size, 0);
+		if (ftruncate(ctx->outfd, hdr.ch_size) != 0)
+			objerr(ctx, "failed to truncate %s", ctx->path);
+		obj_write_end(ctx);
 	}
-	return (NULL);
+	hit = true;
+
+	/* Keep recently used entries from being evicted. */
+	(void)futimens(fd, NULL);
+out:
+	free(buf);
+	close(fd);
+	return (hit);
 }
 
-/* Return the name of the specified section. */
-static const char *
-get_section_name(Elf *e, Elf_Scn *scn)
+/*
+ * Look the object up in the result cache. Returns true if the cached result
+ * was applied, in which case nothing more needs to be done with the object.
+ * Otherwise the hashes of the input are left in the context so that the result
+ * can be stored once the object has been processed.
+ */
+static bool
+cache_lookup(struct objctx *ctx)
 {
-	GElf_Shdr shdr;
-	size_t ndx;
+	struct cache *cache;
+	char name[80];
+	bool hit;
+
+	cache = ctx->cache;
+	hash_file(ctx, ctx->sb.st_size);
+
+	cache_name(ctx, name, sizeof(name), false);
+	hit = cache_get(ctx, name, CACHE_UNCHANGED);
+	if (!hit) {
+		cache_name(ctx, name, sizeof(name), true);
+		hit = cache_get(ctx, name, CACHE_PATCHED);
+	}
+	if (hit)
+		LOG(ctx, "using cached result for %s", ctx->path);
+
+	pthread_mutex_lock(&cache->lock);
+	if (hit)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
 
-	if (gelf_getshdr(scn, &shdr) != &shdr)
-		errx(1, "gelf_getshdr: %s", ELF_ERR());
-	if (elf_getshdrstrndx(e, &ndx) != 0)
-		errx(1, "elf_getshdrstrndx: %s", ELF_ERR());
-	return (elf_strptr(e, ndx, shdr.sh_name));
+	return (hit);
 }
 
 /*
- * Create a linker set for the set of probe instances (set_sdt_instances_set),
- * and create a relocation section for it.
+ * Format the name of the cache entry for the current input hash. Entries for
+ * patched objects include the object's ftok(3) key, see record_instance(), and
+ * the encoding used for disabled probe sites.
  */
 static void
-init_new_sections(Elf *e, Elf_Scn *symscn, Elf_Scn **instscn,
-    Elf_Scn **instrelscn, size_t scnsz)
+cache_name(struct objctx *ctx, char *buf, size_t len, bool patched)
 {
-	Elf64_Sym sym64;
-	Elf32_Sym sym32;
-	GElf_Shdr symshdr;
-	Elf_Data *data;
-	Elf_Scn *strscn;
-	const char *startset, *stopset;
-	void *sym;
-	size_t startoff, stopoff, symsz;
 
-	*instscn = add_section(e, "set_sdt_instances_set", SHT_PROGBITS,
-	    SHF_ALLOC);
+	if (!patched) {
+		snprintf(buf, len, "%016" PRIx64 "-%jd", ctx->hash,
+		    (intmax_t)ctx->hashsize);
+		return;
+	}
 
-	if ((data = elf_newdata(*instscn)) == NULL)
-		errx(1, "elf_newdata (set_sdt_instances_set): %s", ELF_ERR());
+	snprintf(buf, len, "%016" PRIx64 "-%jd-%ld-%s", ctx->hash,
+	    (intmax_t)ctx->hashsize, obj_key(ctx), ctx->nops->name);
+}
 
-	data->d_align = wordsize(e);
-	data->d_buf = xmalloc(scnsz);
-	data->d_size = scnsz;
-	memset(data->d_buf, 0, scnsz);
+static struct cache *
+cache_open(const char *dir, uint64_t maxsize)
+{
+	struct cache *cache;
 
-	assert(expand_section(*instscn, data->d_size) == 0);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		err(1, "failed to create cache directory %s", dir);
 
-	*instrelscn = add_reloc_section(e, *instscn, symscn);
+	cache = xmalloc(sizeof(*cache));
+	memset(cache, 0, sizeof(*cache));
+	cache->dir = dir;
+	cache->maxsize = maxsize;
+	if ((cache->dirfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+		err(1, "failed to open cache directory %s", dir);
+	pthread_mutex_init(&cache->lock, NULL);
 
-	/*
-	 * Create __start_<set> and __stop_<set> variables so that the kernel
-	 * can find the section address. They're magic symbols that are
-	 * instantiated by the linker.
-	 */
-	if (gelf_getshdr(symscn, &symshdr) != &symshdr)
-		errx(1, "gelf_getshdr (%s): %s", get_section_name(e, symscn),
-		    ELF_ERR());
-	if ((strscn = elf_getscn(e, symshdr.sh_link)) == NULL)
-		errx(1, "failed to find string table for %s: %s",
-		    get_section_name(e, symscn), ELF_ERR());
+	return (cache);
+}
 
-	startset = "__start_set_sdt_instances_set";
-	startoff = append_data(e, strscn, startset, strlen(startset) + 1);
-	stopset = "__stop_set_sdt_instances_set";
-	stopoff = append_data(e, strscn, stopset, strlen(stopset) + 1);
+/*
+ * Add an entry to the cache. The entry is created under a temporary name and
+ * renamed into place, so concurrent sdtpatch processes sharing the cache never
+ * see a partially written entry. Failures are not fatal: the object has already
+ * been processed at this point.
+ */
+static void
+cache_put(struct cache *cache, const char *name, uint32_t kind, uint64_t check,
+    const void *data, size_t size)
+{
+	struct cache_hdr hdr;
+	struct iovec iov[2];
+	char tmp[PATH_MAX];
+	ssize_t n;
+	int fd;
 
-	switch (gelf_getclass(e)) {
-	case ELFCLASS32:
-		memset(&sym32, 0, sizeof(sym32));
-		sym32.st_info = ELF32_ST_INFO(STB_WEAK, STT_NOTYPE);
+	if (sizeof(hdr) + size > cache->maxsize)
+		return;
 
-		symsz = sizeof(sym32);
-		sym = &sym32;
-		break;
-	case ELFCLASS64:
-		memset(&sym64, 0, sizeof(sym64));
-		sym64.st_info = ELF64_ST_INFO(STB_WEAK, STT_NOTYPE);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.ch_magic, CACHE_MAGIC, sizeof(hdr.ch_magic));
+	hdr.ch_version = CACHE_VERSION;
+	hdr.ch_kind = kind;
+	hdr.ch_check = check;
+	hdr.ch_size = size;
 
-		symsz = sizeof(sym64);
-		sym = &sym64;
-		break;
-	default:
-		errx(1, "unexpected ELF class %d", gelf_getclass(e));
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", cache->dir);
+	if ((fd = mkstemp(tmp)) < 0) {
+		warn("failed to create cache entry in %s", cache->dir);
+		return;
 	}
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = __DECONST(void *, data);
+	iov[1].iov_len = size;
+	n = writev(fd, iov, nitems(iov));
+	if (n < 0 || (size_t)n != sizeof(hdr) + size) {
+		warnx("failed to write cache entry %s", tmp);
+		goto fail;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		warn("failed to write cache entry %s", tmp);
+		goto fail;
+	}
+	if (renameat(AT_FDCWD, tmp, cache->dirfd, name) != 0) {
+		fd = -1;
+		warn("failed to rename cache entry %s", tmp);
+		goto fail;
+	}
+	return;
 
-	sym32.st_name = startoff;
-	sym64.st_name = startoff;
-	append_data(e, symscn, sym, symsz);
-
-	sym32.st_name = stopoff;
-	sym64.st_name = stopoff;
-	append_data(e, symscn, sym, symsz);
+fail:
+	if (fd >= 0)
+		close(fd);
+	(void)unlink(tmp);
 }
 
-static int
-process_reloc(Elf *e, GElf_Ehdr *ehdr, GElf_Shdr *symshdr, Elf_Scn *symscn,
-    uint8_t *target, GElf_Addr offset, GElf_Xword *info,
-    struct probe_list *plist)
+static void
+cache_report(struct cache *cache)
 {
-	GElf_Sym funcsym;
-	struct probe_instance *inst;
-	GElf_Sym *sym;
-	const char *symname;
-	Elf64_Xword nulrel;
-	uint8_t opc;
-
-	sym = symbol_by_index(symscn, GELF_R_SYM(*info));
-	symname = elf_strptr(e, symshdr->sh_link, sym->st_name);
-	if (symname == NULL)
-		errx(1, "couldn't find symbol name for relocation");
 
-	if (strncmp(symname, probe_prefix, sizeof(probe_prefix) - 1) != 0)
-		/* We're not interested in this relocation. */
-		return (1);
+	warnx("cache: %ju hits, %ju misses, %ju evictions", cache->hits,
+	    cache->misses, cache->evictions);
+}
 
-	/* Sanity checks. */
-	if (GELF_ST_TYPE(sym->st_info) != STT_NOTYPE)
-		errx(1, "unexpected symbol type %d for %s",
-		    GELF_ST_TYPE(sym->st_info), symname);
-	if (GELF_ST_BIND(sym->st_info) != STB_GLOBAL)
-		errx(1, "unexpected binding %d for %s",
-		    GELF_ST_BIND(sym->st_info), symname);
-
-	switch (ehdr->e_machine) {
-	case EM_X86_64:
-		/* Sanity checks. */
-		if (GELF_R_TYPE(*info) != R_X86_64_64 &&
-		    GELF_R_TYPE(*info) != R_X86_64_PC32) {
-			if (GELF_R_TYPE(*info) != R_X86_64_NONE)
-				errx(1,
-			    "unexpected relocation type 0x%lx against %s",
-				    GELF_R_TYPE(*info), symname);
-			/* We've presumably already processed this file. */
-			return (1);
+/*
+ * Record the result of processing an object. When the object was patched, the
+ * output is itself recorded as needing no changes, so that running sdtpatch
+ * again on it is cheap.
+ */
+static void
+cache_store(struct objctx *ctx, bool patched)
+{
+	struct stat sb;
+	uint8_t *buf;
+	char name[80];
+	ssize_t n;
+
+	if (patched) {
+		if (fstat(ctx->outfd, &sb) != 0) {
+			objwarnx(ctx, "failed to stat %s: %s", ctx->path,
+			    strerror(errno));
+			return;
+		}
+		buf = xmalloc(sb.st_size);
+		n = pread(ctx->outfd, buf, sb.st_size, 0);
+		if (n != sb.st_size) {
+			objwarnx(ctx, "failed to read back %s", ctx->path);
+			free(buf);
+			return;
 		}
-		opc = target[offset - 1];
-		if (opc != AMD64_CALL && opc != AMD64_JMP32)
-			errx(1, "unexpected opcode 0x%x for %s at offset 0x%lx",
-			    opc, symname, offset);
-
-		if (target[offset + 0] != 0 ||
-		    target[offset + 1] != 0 ||
-		    target[offset + 2] != 0 ||
-		    target[offset + 3] != 0)
-			errx(1, "unexpected addr for %s at offset 0x%lx",
-			    symname, offset);
-
-		/* Overwrite the call with NOPs. */
-		memset(&target[offset - 1], AMD64_NOP, 5);
 
-		/* If this was a tail call, we need to return instead. */
-		if (opc == AMD64_JMP32)
-			target[offset] = AMD64_RETQ;
+		cache_name(ctx, name, sizeof(name), true);
+		cache_put(ctx->cache, name, CACHE_PATCHED, ctx->check, buf,
+		    sb.st_size);
 
-		nulrel = R_X86_64_NONE;
-		break;
-	default:
-		errx(1, "unhandled machine type 0x%x", ehdr->e_machine);
+		ctx->hash = xxh64(buf, sb.st_size, 0);
+		ctx->check = xxh64(buf, sb.st_size, 1);
+		ctx->hashsize = sb.st_size;
+		free(buf);
 	}
 
-	/* Make sure the linker ignores this relocation. */
-	*info = GELF_R_INFO(0UL, nulrel);
-
-	LOG("updated relocation for %s at 0x%lx", symname, offset - 1);
-
-	inst = xmalloc(sizeof(*inst));
-	inst->symname = symname;
-	if (symbol_by_offset(symscn, offset, &funcsym, &inst->symndx) != 1)
-		errx(1, "failed to look up function for probe %s", symname);
-	inst->offset = offset - funcsym.st_value;
-
-	SLIST_INSERT_HEAD(plist, inst, next);
-
-	return (0);
+	cache_name(ctx, name, sizeof(name), false);
+	cache_put(ctx->cache, name, CACHE_UNCHANGED, ctx->check, NULL, 0);
 }
 
 /*
- * Look for relocations against DTrace probe stubs. Such relocations are used to
- * populate the probe instance list (plist) and then invalidated, since we
- * overwrite the call site with NOPs.
+ * Evict least recently used entries until the cache is below its size limit.
+ * Some slack is left so that this does not have to happen on every run. The
+ * cache is locked throughout, since concurrent server requests may each trim it.
  */
 static void
-process_reloc_section(Elf *e, GElf_Ehdr *ehdr, GElf_Shdr *shdr, Elf_Scn *scn,
-    struct probe_list *plist)
+cache_trim(struct cache *cache)
 {
-	GElf_Shdr symshdr;
-	GElf_Rel rel;
-	GElf_Rela rela;
-	Elf_Data *reldata, *targdata;
-	Elf_Scn *symscn, *targscn;
-	const char *name;
-	u_int i;
-	int ret;
-
-	if ((targscn = elf_getscn(e, shdr->sh_info)) == NULL)
-		errx(1, "failed to look up relocation section: %s", ELF_ERR());
-	if ((targdata = elf_getdata(targscn, NULL)) == NULL)
-		errx(1, "failed to look up target section data: %s", ELF_ERR());
-
-	/* We only want to process relocations against the text section. */
-	name = get_section_name(e, targscn);
-	if (strcmp(name, ".text") != 0) {
-		LOG("skipping relocation section for %s", name);
+	struct cache_ent *ents;
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	uint64_t target, total;
+	size_t cap, i, nents;
+	int fd;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((fd = dup(cache->dirfd)) < 0 || (dirp = fdopendir(fd)) == NULL) {
+		warn("failed to open cache directory %s", cache->dir);
+		if (fd >= 0)
+			(void)close(fd);
+		pthread_mutex_unlock(&cache->lock);
 		return;
 	}
-
-	if ((symscn = elf_getscn(e, shdr->sh_link)) == NULL)
-		errx(1, "failed to look up symbol table: %s", ELF_ERR());
-	if (gelf_getshdr(symscn, &symshdr) == NULL)
-		errx(1, "failed to look up symbol table header: %s", ELF_ERR());
-
-	i = 0;
-	for (reldata = NULL; (reldata = elf_getdata(scn, reldata)) != NULL; ) {
-		for (; i < shdr->sh_size / shdr->sh_entsize; i++) {
-			if (shdr->sh_type == SHT_REL) {
-				if (gelf_getrel(reldata, i, &rel) == NULL)
-					errx(1, "gelf_getrel: %s", ELF_ERR());
-				ret = process_reloc(e, ehdr, &symshdr, symscn,
-				    targdata->d_buf, rel.r_offset, &rel.r_info,
-				    plist);
-				if (ret == 0 &&
-				    gelf_update_rel(reldata, i, &rel) == 0)
-					errx(1, "gelf_update_rel: %s",
-					    ELF_ERR());
-			} else {
-				assert(shdr->sh_type == SHT_RELA);
-				if (gelf_getrela(reldata, i, &rela) == NULL)
-					errx(1, "gelf_getrela: %s", ELF_ERR());
-				ret = process_reloc(e, ehdr, &symshdr, symscn,
-				    targdata->d_buf, rela.r_offset,
-				    &rela.r_info, plist);
-				if (ret == 0 &&
-				    gelf_update_rela(reldata, i, &rela) == 0)
-					errx(1, "gelf_update_rela: %s",
-					    ELF_ERR());
-			}
-
-			/*
-			 * We've updated the relocation and the corresponding
-			 * text section.
-			 */
-			if (ret == 0) {
-				if (elf_flagdata(targdata, ELF_C_SET,
-				    ELF_F_DIRTY) == 0)
-					errx(1, "elf_flagdata: %s", ELF_ERR());
-				if (elf_flagdata(reldata, ELF_C_SET,
-				    ELF_F_DIRTY) == 0)
-					errx(1, "elf_flagdata: %s", ELF_ERR());
-			}
+	rewinddir(dirp);
+
+	nents = 0;
+	cap = 64;
+	ents = xmalloc(cap * sizeof(*ents));
+	total = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		/* Skip dot files, including in-progress entries. */
+		if (dp->d_name[0] == '.')
+			continue;
+		if (fstatat(cache->dirfd, dp->d_name, &sb,
+		    AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(sb.st_mode))
+			continue;
+		if (nents == cap) {
+			cap *= 2;
+			if ((ents = realloc(ents, cap * sizeof(*ents))) == NULL)
+				err(1, "realloc");
 		}
+		if ((ents[nents].name = strdup(dp->d_name)) == NULL)
+			err(1, "strdup");
+		ents[nents].size = sb.st_size;
+		ents[nents].mtime = sb.st_mtim;
+		nents++;
+		total += sb.st_size;
 	}
+	closedir(dirp);
+
+	if (total > cache->maxsize) {
+		target = cache->maxsize - cache->maxsize / 10;
+		qsort(ents, nents, sizeof(*ents), cache_ent_cmp);
+		for (i = 0; i < nents && total > target; i++) {
+			if (unlinkat(cache->dirfd, ents[i].name, 0) != 0 &&
+			    errno != ENOENT)
+				continue;
+			total -= ents[i].size;
+			cache->evictions++;
+		}
+	}
+
+	for (i = 0; i < nents; i++)
+		free(ents[i].name);
+	free(ents);
+	pthread_mutex_unlock(&cache->lock);
 }
 
 /*
- * Process an input object file. This function choreographs the work done by
- * sdtpatch: it first processes all the relocations against the DTrace probe
- * stubs and uses the information from those relocations to build up a list
- * (plist) of probe sites. It then adds information about each probe site to the
- * object file, later used by the SDT kernel module to actually create DTrace
- * probes.
+ * Client mode: have a server started with --serve process the objects. Paths
+ * are made absolute, since the server may have a different working directory.
+ * Returns the exit status, which is non-zero if any object failed.
  */
+static int
+client(const char *sockpath, const struct pathlist *pl)
+{
+	struct sockaddr_un sun;
+	FILE *in, *out;
+	char buf[BUFSIZ], cwd[PATH_MAX], status[16], *line;
+	size_t i, len, linecap, n;
+	int s, ret;
+
+	sockaddr_init(&sun, sockpath);
+	if ((s = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+		err(1, "failed to connect to %s", sockpath);
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		err(1, "getcwd");
+
+	if ((out = fdopen(dup(s), "w")) == NULL)
+		err(1, "fdopen");
+	for (i = 0; i < pl->count; i++) {
+		if (pl->paths[i][0] != '/')
+			fprintf(out, "%s/", cwd);
+		fputs(pl->paths[i], out);
+		fputc('\0', out);
+	}
+	if (fflush(out) != 0 || shutdown(s, SHUT_WR) != 0)
+		err(1, "failed to send request to %s", sockpath);
+	(void)fclose(out);
+
+	if ((in = fdopen(s, "r")) == NULL)
+		err(1, "fdopen");
+	ret = 0;
+	line = NULL;
+	linecap = 0;
+	for (i = 0; i < pl->count; i++) {
+		if (getline(&line, &linecap, in) <= 0 ||
+		    sscanf(line, "%15s %zu", status, &len) != 2)
+			errx(1, "invalid reply from %s", sockpath);
+		for (; len > 0; len -= n) {
+			n = fread(buf, 1, MIN(len, sizeof(buf)), in);
+			if (n == 0)
+				errx(1, "invalid reply from %s", sockpath);
+			fwrite(buf, 1, n, stderr);
+		}
+		if (strcmp(status, "ok") != 0)
+			ret = 1;
+	}
+	free(line);
+	(void)fclose(in);
+
+	return (ret);
+}
+
+/* Emit the diagnostics buffered while processing an object. */
 static void
-process_obj(const char *obj)
+diag_flush(struct objctx *ctx, void *arg __unused)
 {
-	struct probe_list plist;
-	GElf_Ehdr ehdr;
-	GElf_Shdr shdr;
-	struct probe_instance *inst;
-	Elf_Scn *scn, *datarelscn, *instscn, *instrelscn, *datascn, *symscn;
-	Elf *e;
-	char *objpath;
-	int fd, cnt, ndx;
 
-	g_currobj = obj;
+	if (ctx->diaglen > 0)
+		fwrite(ctx->diagbuf, 1, ctx->diaglen, stderr);
+}
 
-	if ((fd = open(obj, O_RDWR)) < 0)
-		err(1, "failed to open %s", obj);
+/*
+ * Return the function interval table for section shndx, building it from the
+ * specified symbol table on the first lookup for that section. Objects without
+ * probes thus never pay for the table.
+ * Zero-sized function symbols are omitted since they cannot contain any
+ * offset.
+ */
+static struct functab *
+functab_get(struct objctx *ctx, size_t symndx, size_t shndx)
+{
+	struct functab *ftab;
+	uint64_t maxend;
+	size_t i, nsyms;
+
+	SLIST_FOREACH(ftab, &ctx->functabs, next)
+		if (ftab->shndx == shndx)
+			return (ftab);
+
+	nsyms = symbol_count(ctx, symndx);
+	ftab = arena_alloc(&ctx->arena, sizeof(*ftab));
+	ftab->shndx = shndx;
+	ftab->ivs = arena_alloc(&ctx->arena, nsyms * sizeof(*ftab->ivs));
+	ftab->count = 0;
+	CLASS_DISPATCH(ctx, functab_scan, ctx, symndx, ftab);
+
+	qsort(ftab->ivs, ftab->count, sizeof(*ftab->ivs), func_interval_cmp);
+	for (i = 0, maxend = 0; i < ftab->count; i++) {
+		if (ftab->ivs[i].end > maxend)
+			maxend = ftab->ivs[i].end;
+		ftab->ivs[i].maxend = maxend;
+	}
 
-	if ((e = elf_begin(fd, ELF_C_RDWR, NULL)) == NULL)
-		errx(1, "elf_begin: %s", ELF_ERR());
+	SLIST_INSERT_HEAD(&ctx->functabs, ftab, next);
+	return (ftab);
+}
 
-	if (gelf_getehdr(e, &ehdr) == NULL)
-		errx(1, "gelf_getehdr: %s", ELF_ERR());
-	if (ehdr.e_type != ET_REL) {
-		warnx("invalid ELF type for '%s'", obj);
-		return;
+/* Collect the function symbols defined in ftab's section. */
+static __always_inline void
+functab_scan(struct objctx *ctx, size_t symndx, struct functab *ftab,
+    int class)
+{
+	GElf_Sym sym;
+	struct func_interval *iv;
+	const uint8_t *data;
+	size_t i, nsyms;
+
+	data = ctx->scns[symndx].data;
+	nsyms = symbol_count(ctx, symndx);
+	for (i = 0; i < nsyms; i++) {
+		symbol_load(data, i, &sym, class);
+		if (GELF_ST_TYPE(sym.st_info) != STT_FUNC ||
+		    sym.st_shndx != ftab->shndx || sym.st_size == 0)
+			continue;
+		iv = &ftab->ivs[ftab->count++];
+		iv->start = sym.st_value;
+		iv->end = sym.st_value + sym.st_size;
+		iv->symndx = i;
 	}
+}
 
-	SLIST_INIT(&plist);
+static int
+func_interval_cmp(const void *a, const void *b)
+{
+	const struct func_interval *iv1, *iv2;
 
-	/* Hijack relocations for DTrace probe stub calls. */
+	iv1 = a;
+	iv2 = b;
+	if (iv1->start != iv2->start)
+		return (iv1->start < iv2->start ? -1 : 1);
+	return (iv1->symndx < iv2->symndx ? -1 : iv1->symndx > iv2->symndx);
+}
 
-	for (scn = NULL; (scn = elf_nextscn(e, scn)) != NULL; ) {
-		if (gelf_getshdr(scn, &shdr) == NULL)
-			errx(1, "gelf_getshdr: %s", ELF_ERR());
+/*
+ * Find the relocation section associated with a given ELF section and symbol
+ * table. Returns SHN_UNDEF if there is none.
+ */
+static size_t
+get_reloc_section(struct objctx *ctx, size_t shndx, size_t symndx)
+{
+	GElf_Shdr *shdr;
+	size_t i;
+
+	i = ctx->scns[shndx].relndx;
+	if (i == SHN_UNDEF || ctx->scns[i].shdr.sh_link == symndx)
+		return (i);
+
+	/* Several relocation sections apply to shndx; look for the right one. */
+	for (i = 1; i < ctx->nscns; i++) {
+		shdr = &ctx->scns[i].shdr;
+		if ((shdr->sh_type == SHT_REL || shdr->sh_type == SHT_RELA) &&
+		    shdr->sh_info == shndx && shdr->sh_link == symndx)
+			return (i);
+	}
+	return (SHN_UNDEF);
+}
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(clock, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Return the name of the specified section. */
+static const char *
+get_section_name(struct objctx *ctx, size_t ndx)
+{
+	struct objscn *scn;
+	const char *name;
 
-		if (shdr.sh_type == SHT_REL || shdr.sh_type == SHT_RELA)
-			process_reloc_section(e, &ehdr, &shdr, scn, &plist);
+	scn = &ctx->scns[ndx];
+	if (scn->name == NULL) {
+		name = objstr(ctx, ctx->shstrndx, scn->shdr.sh_name);
+		scn->name = name != NULL ? name : "<unknown>";
 	}
+	return (scn->name);
+}
 
-	if (SLIST_EMPTY(&plist)) {
-		/* No probe instances in this object file, we're done. */
-		LOG("no probes found in %s", obj);
+/* Compute the hashes of the input object used to key the result cache. */
+static void
+hash_file(struct objctx *ctx, off_t size)
+{
+	void *map;
+
+	ctx->hashsize = size;
+	if (size == 0) {
+		ctx->hash = xxh64(NULL, 0, 0);
+		ctx->check = xxh64(NULL, 0, 1);
 		return;
 	}
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, ctx->fd, 0);
+	if (map == MAP_FAILED)
+		objerr(ctx, "failed to map %s", ctx->path);
+	ctx->hash = xxh64(map, size, 0);
+	ctx->check = xxh64(map, size, 1);
+	munmap(map, size);
+}
 
-	/* Now record all of the instance sites. */
+/*
+ * Try to read a token from the jobserver without waiting. The jobserver is read
+ * through a non-blocking descriptor, see jobserver_open(), so the read fails
+ * with EAGAIN if no token is available.
+ */
+static bool
+jobserver_get(struct jobslots *slots, char *tok)
+{
+	ssize_t n;
+
+	while ((n = read(slots->rfd, tok, 1)) < 0 && errno == EINTR)
+		;
+	return (n == 1);
+}
+
+/*
+ * Look for a GNU make jobserver in MAKEFLAGS. make passes either the path of a
+ * FIFO ("--jobserver-auth=fifo:PATH", make 4.4 and later) or a pair of pipe
+ * descriptors ("--jobserver-auth=R,W", or "--jobserver-fds=R,W" before 4.2).
+ * The descriptors are only passed to recipes which make considers recursive,
+ * so if they are not open, the jobserver is ignored. Returns true if a
+ * jobserver was found.
+ */
+static bool
+jobserver_open(struct jobslots *slots)
+{
+	const char *flags;
+	char *auth, *buf, *end, *s, *word;
+	long rfd, wfd;
+
+	slots->rfd = slots->wfd = -1;
+	if ((flags = getenv("MAKEFLAGS")) == NULL)
+		return (false);
+	if ((buf = strdup(flags)) == NULL)
+		err(1, "strdup");
+
+	/* The last option wins. */
+	auth = NULL;
+	for (s = buf; (word = strsep(&s, " \t")) != NULL;) {
+		if (strncmp(word, "--jobserver-auth=", 17) == 0)
+			auth = word + 17;
+		else if (strncmp(word, "--jobserver-fds=", 16) == 0)
+			auth = word + 16;
+	}
+
+	if (auth == NULL) {
+		/* No jobserver. */
+	} else if (strncmp(auth, "fifo:", 5) == 0) {
+		slots->rfd = open(auth + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (slots->rfd < 0)
+			warn("failed to open jobserver %s", auth + 5);
+		slots->wfd = slots->rfd;
+	} else {
+		errno = 0;
+		wfd = -1;
+		rfd = strtol(auth, &end, 10);
+		if (*end == ',')
+			wfd = strtol(end + 1, &end, 10);
+		if (errno != 0 || end == auth || *end != '\0' || rfd < 0 ||
+		    wfd < 0 || rfd > INT_MAX || wfd > INT_MAX)
+			warnx("invalid jobserver '%s'", auth);
+		else if (fcntl(rfd, F_GETFD) == -1 || fcntl(wfd, F_GETFD) == -1) {
+			/*
+			 * make only passes the descriptors to rules marked with
+			 * '+', so this is common and not worth a warning.
+			 */
+		} else if ((slots->rfd = jobserver_reopen(rfd)) < 0)
+			warnx("jobserver pipe cannot be read without blocking");
+		else
+			slots->wfd = wfd;
+	}
+	free(buf);
+	return (slots->rfd >= 0);
+}
 
-	for (scn = NULL, symscn = NULL; (scn = elf_nextscn(e, scn)) != NULL; ) {
-		if (gelf_getshdr(scn, &shdr) == NULL)
-			errx(1, "gelf_getshdr: %s", ELF_ERR());
+/* Return a token to the jobserver. */
+static void
+jobserver_put(struct jobslots *slots, char tok)
+{
 
-		if (shdr.sh_type == SHT_SYMTAB) {
-			symscn = scn;
+	while (write(slots->wfd, &tok, 1) != 1) {
+		if (errno != EINTR) {
+			warn("failed to return a jobserver token");
 			break;
 		}
 	}
-	if (symscn == NULL)
-		errx(1, "couldn't find symbol table in %s", obj);
+}
 
-	if ((datascn = section_by_name(e, ".data")) == NULL)
-		errx(1, "couldn't find data section in %s", obj);
-	if ((datarelscn = get_reloc_section(e, datascn, symscn)) == NULL) {
-		/*
-		 * The object file doesn't have any relocations against the data
-		 * section, so we have to create a relocation section ourselves.
-		 */
-		LOG("adding data relocation section for %s", obj);
-		datarelscn = add_reloc_section(e, datascn, symscn);
+/*
+ * Open a private, non-blocking descriptor for the read end of make's jobserver
+ * pipe. The inherited descriptor shares its file status flags with make and
+ * the other jobs, so it cannot itself be made non-blocking. Opening it again
+ * through /dev/fd yields a new open file description where /dev/fd is provided
+ * by procfs, as on Linux, or fdescfs(5); otherwise -1 is returned.
+ */
+static int
+jobserver_reopen(int fd)
+{
+	char path[32];
+	int flags, nfd;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		return (-1);
+	(void)snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+	if ((nfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return (-1);
+
+	/* A duplicate of fd would share, and may have changed, its flags. */
+	if (fcntl(fd, F_GETFL) != flags ||
+	    (fcntl(nfd, F_GETFL) & O_NONBLOCK) == 0) {
+		(void)fcntl(fd, F_SETFL, flags);
+		(void)close(nfd);
+		return (-1);
 	}
+	return (nfd);
+}
 
-	cnt = 0;
-	SLIST_FOREACH(inst, &plist, next)
-	    cnt++;
-	init_new_sections(e, symscn, &instscn, &instrelscn, cnt * wordsize(e));
+/*
+ * Return the jobserver tokens still held when exiting, for example after an
+ * error, so that it does not reduce the parallelism of the parent make.
+ */
+static void
+jobslots_exit(void)
+{
+	struct jobslots *slots;
+	char tok;
 
-	if ((objpath = realpath(obj, NULL)) == NULL)
-		errx(1, "failed to resolve %s: %s", obj, strerror(errno));
+	if ((slots = exitslots) == NULL || slots->wfd < 0)
+		return;
+	for (;;) {
+		pthread_mutex_lock(&slots->lock);
+		if (slots->ntokens == 0) {
+			pthread_mutex_unlock(&slots->lock);
+			break;
+		}
+		tok = slots->tokens[--slots->ntokens];
+		pthread_mutex_unlock(&slots->lock);
+		jobserver_put(slots, tok);
+	}
+}
 
-	ndx = 0;
-	while ((inst = SLIST_FIRST(&plist)) != NULL) {
-		record_instance(e, &ehdr, symscn, datascn, datarelscn,
-		    instrelscn, inst, ndx++, objpath);
-		SLIST_REMOVE_HEAD(&plist, next);
-		free(inst);
+/* Return job slots taken with jobslots_take(). */
+static void
+jobslots_put(struct jobslots *slots, u_int n)
+{
+	char tok;
+
+	for (tok = 0; n > 0; n--) {
+		pthread_mutex_lock(&slots->lock);
+		if (slots->wfd >= 0)
+			tok = slots->tokens[--slots->ntokens];
+		slots->avail++;
+		pthread_mutex_unlock(&slots->lock);
+		if (slots->wfd >= 0)
+			jobserver_put(slots, tok);
 	}
+}
 
-	if (elf_update(e, ELF_C_WRITE) == -1)
-		errx(1, "elf_update: %s", ELF_ERR());
+/* Take up to "want" job slots without waiting, returning the number taken. */
+static u_int
+jobslots_take(struct jobslots *slots, u_int want)
+{
+	u_int n;
+	char tok;
 
-	(void)elf_end(e);
-	(void)close(fd);
+	for (n = 0; n < want; n++) {
+		pthread_mutex_lock(&slots->lock);
+		if (slots->avail == 0) {
+			pthread_mutex_unlock(&slots->lock);
+			break;
+		}
+		slots->avail--;
+		pthread_mutex_unlock(&slots->lock);
+		if (slots->rfd < 0)
+			continue;
+
+		if (!jobserver_get(slots, &tok)) {
+			pthread_mutex_lock(&slots->lock);
+			slots->avail++;
+			pthread_mutex_unlock(&slots->lock);
+			break;
+		}
+		pthread_mutex_lock(&slots->lock);
+		slots->tokens[slots->ntokens++] = tok;
+		pthread_mutex_unlock(&slots->lock);
+	}
+	return (n);
 }
 
 /*
- * Add a probe instance to the target ELF file. This consists of several steps:
- * - add space for a struct sdt_instance to the data section,
- * - add a symbol table entry for the instance,
- * - add a relocation for the probe field of the struct sdt_instance,
- * - add a relocation for the offset field of the struct sdt_instance,
- * - add a relocation for the probe instance linker set.
+ * Create a linker set for the set of probe instances (set_sdt_instances_set),
+ * and create a relocation section for it.
  */
 static void
-record_instance(Elf *e, GElf_Ehdr *ehdr, Elf_Scn *symscn, Elf_Scn *datascn,
-    Elf_Scn *datarelscn, Elf_Scn *instrelscn, const struct probe_instance *inst,
-    int ndx, const char *objpath)
+init_new_sections(struct objctx *ctx, size_t symndx, size_t cnt)
 {
-	struct sdt_instance sdtinst;
-	Elf64_Rela rela;
 	Elf64_Sym sym64;
 	Elf32_Sym sym32;
-	GElf_Sym probeobjsym;
-	GElf_Shdr symshdr;
-	Elf_Scn *strscn;
-	char *probeobjname, *instsymname;
+	const char *startset, *stopset;
 	void *sym;
-	size_t instoff, nameoff, namesz, relsz, symsz;
-	uint64_t probeobjndx, instndx;
+	size_t instndx, instrelndx, startoff, stopoff, symsz;
+	uint64_t ndx;
 
-	/* Filled in using relocations generated in steps 3 & 4. */
-	memset(&sdtinst, 0, sizeof(sdtinst));
-
-	/*
-	 * Step 1: install the probe instance into the data section.
-	 */
-
-	instoff = append_data(e, datascn, &sdtinst, sizeof(sdtinst));
-	LOG("created probe instance for '%s' at offset %zu", inst->symname,
-	    instoff);
+	instndx = add_section(ctx, "set_sdt_instances_set", SHT_PROGBITS,
+	    SHF_ALLOC);
+	secbuf_init(ctx, &ctx->instbuf, instndx, cnt * wordsize(ctx));
+	(void)secbuf_append(&ctx->instbuf, NULL, cnt * wordsize(ctx));
 
-	/*
-	 * Step 2: add a symbol table entry for the probe instance object.
-	 */
+	instrelndx = add_reloc_section(ctx, instndx, symndx);
+	secbuf_init(ctx, &ctx->instrelbuf, instrelndx,
+	    cnt * sizeof(Elf64_Rela));
 
 	/*
-	 * Step 2.1: create a unique name for the symbol and add it to the
-	 * string table.
+	 * Create __start_<set> and __stop_<set> variables so that the kernel
+	 * can find the section address. They're magic symbols that are
+	 * instantiated by the linker.
 	 */
-	asprintf(&instsymname, "%s%d.%ld", sdtinst_prefix, ndx,
-	    ftok(objpath, 0));
-	if (instsymname == NULL)
-		errx(1, "asprintf: %s", strerror(errno));
-
-	if (gelf_getshdr(symscn, &symshdr) != &symshdr)
-		errx(1, "failed to look up section header for %s: %s",
-		    get_section_name(e, symscn), ELF_ERR());
-	if ((strscn = elf_getscn(e, symshdr.sh_link)) == NULL)
-		errx(1, "failed to find string table for %s: %s",
-		    get_section_name(e, symscn), ELF_ERR());
-	nameoff = append_data(e, strscn, instsymname, strlen(instsymname) + 1);
+	startset = "__start_set_sdt_instances_set";
+	startoff = secbuf_append(&ctx->strbuf, startset, strlen(startset) + 1);
+	stopset = "__stop_set_sdt_instances_set";
+	stopoff = secbuf_append(&ctx->strbuf, stopset, strlen(stopset) + 1);
 
-	/*
-	 * Step 2.2: create the symbol table entry and add it to the table.
-	 */
-	switch (gelf_getclass(e)) {
+	switch (ctx->class) {
 	case ELFCLASS32:
-		sym32.st_name = nameoff;
-		sym32.st_value = instoff;
-		sym32.st_size = sizeof(sdtinst); /* XXX cross-compat... */
-		sym32.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT);
-		sym32.st_other = 0;
-		sym32.st_shndx = elf_ndxscn(datascn);
+		memset(&sym32, 0, sizeof(sym32));
+		sym32.st_info = ELF32_ST_INFO(STB_WEAK, STT_NOTYPE);
 
 		symsz = sizeof(sym32);
 		sym = &sym32;
 		break;
 	case ELFCLASS64:
-		sym64.st_name = nameoff;
-		sym64.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
-		sym64.st_other = 0;
-		sym64.st_shndx = elf_ndxscn(datascn);
-		sym64.st_value = instoff;
-		sym64.st_size = sizeof(sdtinst); /* XXX cross-compat... */
+		memset(&sym64, 0, sizeof(sym64));
+		sym64.st_info = ELF64_ST_INFO(STB_WEAK, STT_NOTYPE);
 
 		symsz = sizeof(sym64);
 		sym = &sym64;
 		break;
 	default:
-		errx(1, "unexpected ELF class %d", gelf_getclass(e));
+		objerrx(ctx, "unexpected ELF class %d", ctx->class);
 	}
 
-	instndx = append_data(e, symscn, sym, symsz) / symsz;
-
-	LOG("added symbol table entry for '%s' at index %ju", inst->symname,
-	    (uintmax_t)instndx);
+	sym32.st_name = startoff;
+	sym64.st_name = startoff;
+	ndx = secbuf_append(&ctx->symbuf, sym, symsz) / symsz;
+	symname_add(&ctx->arena, &ctx->symnames, startset, ndx);
 
-	/*
-	 * Step 3: add a relocation for the object we added in step 2. We need
-	 * to ensure that the instance's probe pointer is set to the
-	 * corresponding struct sdt_probe.
-	 */
+	sym32.st_name = stopoff;
+	sym64.st_name = stopoff;
+	ndx = secbuf_append(&ctx->symbuf, sym, symsz) / symsz;
+	symname_add(&ctx->arena, &ctx->symnames, stopset, ndx);
+}
 
-	/*
-	 * If the probe name is "__dtrace_probe_<foo>", the probe object name is
-	 * "sdt_<foo>".
-	 */
-	namesz = strlen(sdtobj_prefix) + strlen(inst->symname) -
-	    strlen(probe_prefix) + 1;
-	probeobjname = xmalloc(namesz);
-	(void)strlcpy(probeobjname, sdtobj_prefix, namesz);
-	(void)strlcat(probeobjname, inst->symname + strlen(probe_prefix),
-	    namesz);
+/*
+ * Open the object using libelf and load its section table. Each section's data
+ * is obtained with elf_getdata(), which yields a single descriptor for sections
+ * read from a file.
+ */
+static void
+libelf_open(struct objctx *ctx)
+{
+	struct objscn *scn;
+	Elf *e;
+	Elf_Data *data;
+	size_t i, nscns;
 
-	if (symbol_by_name(e, symscn, probeobjname, &probeobjsym,
-	    &probeobjndx) == 0) {
-		/*
-		 * The probe object isn't referenced in this object file, so
-		 * we'll have to add a symbol for it ourselves.
-		 */
-		nameoff = append_data(e, strscn, probeobjname,
-		    strlen(probeobjname) + 1);
+	if ((e = elf_begin(ctx->fd, ELF_C_RDWR, NULL)) == NULL)
+		objerrx(ctx, "elf_begin: %s", ELF_ERR());
+	ctx->e = e;
 
-		memset(sym, 0, symsz);
-		switch (gelf_getclass(e)) {
-		case ELFCLASS32:
-			sym32.st_name = nameoff;
-			sym32.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE);
-			break;
-		case ELFCLASS64:
-			sym64.st_name = nameoff;
-			sym64.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
-			break;
-		default:
-			errx(1, "unexpected ELF class %d", gelf_getclass(e));
+	if (gelf_getehdr(e, &ctx->ehdr) == NULL)
+		objerrx(ctx, "gelf_getehdr: %s", ELF_ERR());
+	if (ctx->ehdr.e_type != ET_REL)
+		return;
+	if ((ctx->class = gelf_getclass(e)) == ELFCLASSNONE)
+		objerrx(ctx, "gelf_getclass: %s", ELF_ERR());
+	/* The header is written back with its size for the class. */
+	if (ctx->ehdr.e_ehsize != (ctx->class == ELFCLASS32 ?
+	    sizeof(Elf32_Ehdr) : sizeof(Elf64_Ehdr)))
+		objerrx(ctx, "invalid ELF header size %u in %s",
+		    (u_int)ctx->ehdr.e_ehsize, ctx->path);
+	if (elf_getshdrnum(e, &nscns) != 0)
+		objerrx(ctx, "elf_getshdrnum: %s", ELF_ERR());
+	if (elf_getshdrstrndx(e, &ctx->shstrndx) != 0)
+		objerrx(ctx, "elf_getshdrstrndx: %s", ELF_ERR());
+
+	ctx->nscns = nscns;
+	ctx->scncap = nscns + 8;
+	if ((ctx->scns = calloc(ctx->scncap, sizeof(*ctx->scns))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nscns; i++) {
+		scn = &ctx->scns[i];
+		if ((scn->scn = elf_getscn(e, i)) == NULL)
+			objerrx(ctx, "elf_getscn: %s", ELF_ERR());
+		if (gelf_getshdr(scn->scn, &scn->shdr) != &scn->shdr)
+			objerrx(ctx, "gelf_getshdr: %s", ELF_ERR());
+		if (i == SHN_UNDEF || scn->shdr.sh_type == SHT_NOBITS)
+			continue;
+		if ((data = elf_getdata(scn->scn, NULL)) != NULL) {
+			scn->edata = data;
+			scn->data = data->d_buf;
+			scn->datasz = data->d_size;
 		}
-		probeobjndx = append_data(e, symscn, sym, symsz) / symsz;
-		LOG("added probe object symbol '%s'", probeobjname);
 	}
-	free(probeobjname);
-
-	switch (ehdr->e_machine) {
-	case EM_X86_64:
-		rela.r_offset = instoff; /* probe pointer is the first field */
-		rela.r_info = ELF64_R_INFO(probeobjndx, R_X86_64_64);
-		rela.r_addend = 0;
+}
 
-		relsz = sizeof(rela);
-		break;
-	default:
-		errx(1, "unhandled machine type 0x%x", ehdr->e_machine);
+/* Record that the specified range of a section was modified in place. */
+static void
+mark_dirty(struct objctx *ctx, size_t ndx, size_t off, size_t len)
+{
+	size_t *hi, *lo;
+	int i;
+
+	if (ctx->shard != NULL) {
+		/* Shards only modify their relocation and target sections. */
+		i = ndx == ctx->shard->relndx ? 0 : 1;
+		lo = &ctx->shard->dirtylo[i];
+		hi = &ctx->shard->dirtyhi[i];
+	} else {
+		lo = &ctx->scns[ndx].dirtylo;
+		hi = &ctx->scns[ndx].dirtyhi;
 	}
-
-	append_data(e, datarelscn, &rela, relsz);
-
-	/*
-	 * Step 4: add a relocation, this time for the offset field of the
-	 * object added in step 2. The SDT code doesn't know where the text
-	 * section of a given linker file is located, so it isn't enough for us
-	 * to just provide the offset into the text section.
-	 */
-
-	switch (ehdr->e_machine) {
-	case EM_X86_64:
-		rela.r_offset = instoff + /* XXX cross-compat */
-		    __offsetof(struct sdt_instance, sdti_offset);
-		rela.r_info = ELF64_R_INFO(inst->symndx, R_X86_64_64);
-		rela.r_addend = inst->offset;
-
-		relsz = sizeof(rela);
-		break;
-	default:
-		errx(1, "unhandled machine type 0x%x", ehdr->e_machine);
+	if (*hi == *lo) {
+		*lo = off;
+		*hi = off + len;
+	} else {
+		*lo = MIN(*lo, off);
+		*hi = MAX(*hi, off + len);
 	}
+}
 
-	append_data(e, datarelscn, &rela, relsz);
-
-	/*
-	 * Step 5: add a relocation for the new probe instance object (created
-	 * in step 1) to the probe instance linker set.
-	 */
-
-	switch (ehdr->e_machine) {
-	case EM_X86_64:
-		rela.r_offset = ndx * wordsize(e);
-		rela.r_info = ELF64_R_INFO(instndx, R_X86_64_64);
-		rela.r_addend = 0;
-
-		relsz = sizeof(rela);
-		break;
-	default:
-		errx(1, "unhandled machine type 0x%x", ehdr->e_machine);
+/*
+ * Try to open the object using the native backend, which maps the file
+ * privately and reads the section headers, symbols and relocations in place.
+ * Only ELF64 objects in the host byte order are handled; for anything else we
+ * return false and the caller falls back to libelf, which also takes care of
+ * diagnosing malformed input.
+ */
+static bool
+native_open(struct objctx *ctx)
+{
+	Elf64_Shdr shdr;
+	struct objscn *scn;
+	struct stat sb;
+	size_t i, nscns, size;
+	void *map;
+
+	if (fstat(ctx->fd, &sb) != 0)
+		objerr(ctx, "failed to stat %s", ctx->path);
+	size = sb.st_size;
+	if (size < sizeof(Elf64_Ehdr))
+		return (false);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, ctx->fd,
+	    0);
+	if (map == MAP_FAILED)
+		objerr(ctx, "failed to map %s", ctx->path);
+	ctx->map = map;
+	ctx->mapsz = size;
+
+	memcpy(&ctx->ehdr, map, sizeof(Elf64_Ehdr));
+	if (memcmp(ctx->ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ctx->ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ctx->ehdr.e_ident[EI_DATA] != ELFDATA_HOST ||
+	    ctx->ehdr.e_ident[EI_VERSION] != EV_CURRENT)
+		goto unsupported;
+	if (ctx->ehdr.e_type != ET_REL)
+		return (true);
+	ctx->class = ELFCLASS64;
+
+	if (ctx->ehdr.e_shoff == 0 ||
+	    ctx->ehdr.e_ehsize != sizeof(Elf64_Ehdr) ||
+	    ctx->ehdr.e_shentsize != sizeof(Elf64_Shdr) ||
+	    ctx->ehdr.e_shoff > size - sizeof(Elf64_Shdr))
+		goto unsupported;
+
+	/* Handle extended section numbering. */
+	memcpy(&shdr, ctx->map + ctx->ehdr.e_shoff, sizeof(shdr));
+	nscns = ctx->ehdr.e_shnum != 0 ? ctx->ehdr.e_shnum : shdr.sh_size;
+	ctx->shstrndx = ctx->ehdr.e_shstrndx != SHN_XINDEX ?
+	    ctx->ehdr.e_shstrndx : shdr.sh_link;
+	if (nscns == 0 ||
+	    nscns > (size - ctx->ehdr.e_shoff) / sizeof(Elf64_Shdr) ||
+	    ctx->shstrndx >= nscns)
+		goto unsupported;
+
+	ctx->nscns = nscns;
+	ctx->scncap = nscns + 8;
+	if ((ctx->scns = calloc(ctx->scncap, sizeof(*ctx->scns))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nscns; i++) {
+		scn = &ctx->scns[i];
+		memcpy(&scn->shdr, ctx->map + ctx->ehdr.e_shoff +
+		    i * sizeof(Elf64_Shdr), sizeof(Elf64_Shdr));
+		if (i == SHN_UNDEF || scn->shdr.sh_type == SHT_NOBITS)
+			continue;
+		if (scn->shdr.sh_offset > size ||
+		    scn->shdr.sh_size > size - scn->shdr.sh_offset)
+			goto unsupported;
+		scn->data = ctx->map + scn->shdr.sh_offset;
+		scn->datasz = scn->shdr.sh_size;
 	}
-
-	append_data(e, instrelscn, &rela, relsz);
-
-	/* Fin. */
+	return (true);
+
+unsupported:
+	free(ctx->scns);
+	ctx->scns = NULL;
+	ctx->nscns = ctx->scncap = 0;
+	(void)munmap(ctx->map, ctx->mapsz);
+	ctx->map = NULL;
+	ctx->mapsz = 0;
+	return (false);
 }
 
-/* Look up an ELF section by name. */
-static Elf_Scn *
-section_by_name(Elf *e, const char *name)
+/* Release all resources associated with the open object. */
+static void
+obj_close(struct objctx *ctx)
 {
-	Elf_Scn *scn;
 
-	for (scn = NULL; (scn = elf_nextscn(e, scn)) != NULL; )
-		if (strcmp(get_section_name(e, scn), name) == 0)
-			return (scn);
-	return (NULL);
+	if (ctx->e != NULL)
+		(void)elf_end(ctx->e);
+	if (ctx->map != NULL)
+		(void)munmap(ctx->map, ctx->mapsz);
+	if (ctx->ring != NULL)
+		uring_discard(ctx->ring);
+	if (ctx->outfd >= 0 && ctx->outfd != ctx->fd)
+		(void)close(ctx->outfd);
+	if (ctx->fd >= 0)
+		(void)close(ctx->fd);
+	free(ctx->scns);
+	ctx->e = NULL;
+	ctx->map = NULL;
+	ctx->mapsz = 0;
+	ctx->fd = ctx->outfd = -1;
+	ctx->scns = NULL;
+	ctx->nscns = ctx->scncap = 0;
+	ctx->nwrites = 0;
 }
 
 /*
- * Look up a symbol by name from the specified symbol table. Return 1 if a
- * matching symbol was found, 0 otherwise.
+ * Return the object's ftok(3) key, which is part of the names of the symbols
+ * added to it. The key is computed once, before the object is written, since
+ * replacing the object with -S changes its inode and thus its key.
  */
-static int
-symbol_by_name(Elf *e, Elf_Scn *scn, const char *name, GElf_Sym *sym,
-    uint64_t *ndx)
+static long
+obj_key(struct objctx *ctx)
 {
-	GElf_Shdr shdr;
-	Elf_Data *data;
-	const char *symname;
-	u_int i;
-
-	if (gelf_getshdr(scn, &shdr) != &shdr)
-		errx(1, "gelf_getshdr: %s", ELF_ERR());
+	char *objpath;
 
-	*ndx = 0;
-	for (data = NULL; (data = elf_getdata(scn, data)) != NULL; ) {
-		for (i = 0; i * shdr.sh_entsize < data->d_size; i++, (*ndx)++) {
-			if (gelf_getsym(data, i, sym) == NULL)
-				errx(1, "gelf_getsym: %s", ELF_ERR());
-			symname = elf_strptr(e, shdr.sh_link, sym->st_name);
-			if (symname != NULL && strcmp(name, symname) == 0)
-				return (1); /* There's my chippy. */
-		}
+	if (!ctx->haskey) {
+		if ((objpath = realpath(ctx->path, NULL)) == NULL)
+			objerrx(ctx, "failed to resolve %s: %s", ctx->path,
+			    strerror(errno));
+		ctx->key = ftok(objpath, 0);
+		ctx->haskey = true;
+		free(objpath);
 	}
-	return (0);
+	return (ctx->key);
 }
 
 /*
- * Look up a function symbol by offset. Return 1 if a matching symbol was found,
- * 0 otherwise.
+ * Load an opened object file using the native backend if possible, and libelf
+ * otherwise. Return 0 if the object is a relocatable file that we can process,
+ * and -1 otherwise.
  */
 static int
-symbol_by_offset(Elf_Scn *scn, uint64_t offset, GElf_Sym *sym, uint64_t *ndx)
+obj_open(struct objctx *ctx)
 {
-	GElf_Shdr shdr;
-	Elf_Data *data;
-	u_int i;
 
-	if (gelf_getshdr(scn, &shdr) != &shdr)
-		errx(1, "gelf_getshdr: %s", ELF_ERR());
+	if (ctx->uselibelf || !native_open(ctx))
+		libelf_open(ctx);
 
-	*ndx = 0;
-	for (data = NULL; (data = elf_getdata(scn, data)) != NULL; ) {
-		for (i = 0; i * shdr.sh_entsize < data->d_size; i++, (*ndx)++) {
-			if (gelf_getsym(data, i, sym) == NULL)
-				errx(1, "gelf_getsym: %s", ELF_ERR());
-			if (GELF_ST_TYPE(sym->st_info) == STT_FUNC &&
-			    offset >= sym->st_value &&
-			    offset < sym->st_value + sym->st_size)
-				return (1);
-		}
+	if (ctx->ehdr.e_type != ET_REL) {
+		objwarnx(ctx, "invalid ELF type for '%s'", ctx->path);
+		return (-1);
 	}
+	scndir_init(ctx);
 	return (0);
 }
 
 /*
- * Retrieve the symbol at index ndx in the specified symbol table, with bounds
- * checking.
+ * Write data of the specified type at the given file offset, converting it to
+ * the file representation if the object was opened with libelf. The types used
+ * here have the same size in memory and in the file.
  */
-static GElf_Sym *
-symbol_by_index(Elf_Scn *symtab, int ndx)
+static void
+obj_pwrite(struct objctx *ctx, Elf_Type type, const void *buf, size_t len,
+    off_t off)
 {
-	Elf_Data *symdata;
+	Elf_Data dst, src;
+
+	if (ctx->e == NULL || len == 0) {
+		uring_pwrite(ctx, buf, len, off);
+		return;
+	}
 
-	if ((symdata = elf_getdata(symtab, NULL)) == NULL)
-		errx(1, "couldn't find symbol table data: %s", ELF_ERR());
-	if (symdata->d_size < (ndx + 1) * sizeof(GElf_Sym))
-		errx(1, "invalid symbol index %d", ndx);
-	return (&((GElf_Sym *)symdata->d_buf)[ndx]);
+	memset(&src, 0, sizeof(src));
+	src.d_buf = __DECONST(void *, buf);
+	src.d_size = len;
+	src.d_type = type;
+	src.d_version = EV_CURRENT;
+	dst = src;
+	dst.d_buf = arena_alloc(&ctx->arena, len);
+	if (gelf_xlatetof(ctx->e, &dst, &src, ctx->ehdr.e_ident[EI_DATA]) ==
+	    NULL)
+		objerrx(ctx, "gelf_xlatetof: %s", ELF_ERR());
+	if (dst.d_size != len)
+		objerrx(ctx, "unexpected file size %zu for type %d", dst.d_size,
+		    type);
+	uring_pwrite(ctx, dst.d_buf, len, off);
 }
 
-static int
-wordsize(Elf *e)
+/*
+ * Ask the kernel to start reading an object which will be processed soon, so
+ * that the I/O overlaps with the processing of the objects before it. The
+ * whole file is read, although objects without probes are later skipped after
+ * reading only their headers and string tables.
+ */
+static void
+obj_readahead(const char *path)
 {
-	int class;
+	int fd;
 
-	if ((class = gelf_getclass(e)) == ELFCLASSNONE)
-		errx(1, "gelf_getclass() returned ELFCLASSNONE");
-	else if (class != ELFCLASS32 && class != ELFCLASS64)
-		errx(1, "gelf_getclass() returned unexpected class %d", class);
-	return (class == ELFCLASS32 ? 4 : 8);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	(void)close(fd);
+}
+
+/*
+ * Write out the object. Sections that grew are copied to the end of the file
+ * together with their appended data, and new sections are placed after them,
+ * followed by a new section header table. Sections modified in place are only
+ * written where they changed. The ELF header is updated last. The old copies
+ * of moved sections and the old section header table are left behind as
+ * unreferenced bytes.
+ *
+ * Objects opened with libelf are written in the same way rather than with
+ * elf_update(), which would rewrite the entire file; libelf is only used to
+ * convert the data to the file representation.
+ */
+static void
+obj_write(struct objctx *ctx)
+{
+	Elf32_Ehdr ehdr32;
+	Elf32_Shdr *shdr32;
+	struct objscn *scn;
+	struct stat sb;
+	const void *ehdr;
+	void *shdrs;
+	size_t ehdrsz, entsz, hi, i, lo, shdrsz;
+	off_t off;
+
+	if (ctx->e == NULL)
+		off = ctx->mapsz;
+	else if (fstat(ctx->fd, &sb) == 0)
+		off = sb.st_size;
+	else
+		objerr(ctx, "failed to stat %s", ctx->path);
+
+	for (i = 1; i < ctx->nscns; i++) {
+		scn = &ctx->scns[i];
+		if (!scn->isnew && (scn->sb == NULL || scn->sb->len == 0))
+			continue;
+
+		if (scn->shdr.sh_addralign > 1)
+			off = roundup(off, scn->shdr.sh_addralign);
+		obj_pwrite(ctx, section_data_type(scn), scn->data, scn->datasz,
+		    off);
+		if (scn->sb != NULL)
+			obj_pwrite(ctx, section_data_type(scn), scn->sb->buf,
+			    scn->sb->len, off + scn->datasz);
+		scn->shdr.sh_offset = off;
+		off += scn->shdr.sh_size;
+
+		/* The section was written out in its entirety. */
+		scn->dirtylo = scn->dirtyhi = 0;
+	}
+
+	if (ctx->nscns >= SHN_LORESERVE) {
+		ctx->scns[0].shdr.sh_size = ctx->nscns;
+		ctx->ehdr.e_shnum = 0;
+	} else {
+		ctx->scns[0].shdr.sh_size = 0;
+		ctx->ehdr.e_shnum = ctx->nscns;
+	}
+	off = roundup(off, wordsize(ctx));
+	ctx->ehdr.e_shoff = off;
+
+	if (ctx->class == ELFCLASS32) {
+		shdrsz = sizeof(Elf32_Shdr);
+		shdrs = arena_alloc(&ctx->arena, ctx->nscns * shdrsz);
+		for (i = 0; i < ctx->nscns; i++) {
+			shdr32 = (Elf32_Shdr *)shdrs + i;
+			shdr32->sh_name = ctx->scns[i].shdr.sh_name;
+			shdr32->sh_type = ctx->scns[i].shdr.sh_type;
+			shdr32->sh_flags = ctx->scns[i].shdr.sh_flags;
+			shdr32->sh_addr = ctx->scns[i].shdr.sh_addr;
+			shdr32->sh_offset = ctx->scns[i].shdr.sh_offset;
+			shdr32->sh_size = ctx->scns[i].shdr.sh_size;
+			shdr32->sh_link = ctx->scns[i].shdr.sh_link;
+			shdr32->sh_info = ctx->scns[i].shdr.sh_info;
+			shdr32->sh_addralign = ctx->scns[i].shdr.sh_addralign;
+			shdr32->sh_entsize = ctx->scns[i].shdr.sh_entsize;
+		}
+
+		memcpy(ehdr32.e_ident, ctx->ehdr.e_ident, EI_NIDENT);
+		ehdr32.e_type = ctx->ehdr.e_type;
+		ehdr32.e_machine = ctx->ehdr.e_machine;
+		ehdr32.e_version = ctx->ehdr.e_version;
+		ehdr32.e_entry = ctx->ehdr.e_entry;
+		ehdr32.e_phoff = ctx->ehdr.e_phoff;
+		ehdr32.e_shoff = ctx->ehdr.e_shoff;
+		ehdr32.e_flags = ctx->ehdr.e_flags;
+		ehdr32.e_ehsize = ctx->ehdr.e_ehsize;
+		ehdr32.e_phentsize = ctx->ehdr.e_phentsize;
+		ehdr32.e_phnum = ctx->ehdr.e_phnum;
+		ehdr32.e_shentsize = ctx->ehdr.e_shentsize;
+		ehdr32.e_shnum = ctx->ehdr.e_shnum;
+		ehdr32.e_shstrndx = ctx->ehdr.e_shstrndx;
+		ehdr = &ehdr32;
+		ehdrsz = sizeof(ehdr32);
+	} else {
+		/* GElf structures have the ELF64 layout. */
+		shdrsz = sizeof(Elf64_Shdr);
+		shdrs = arena_alloc(&ctx->arena, ctx->nscns * shdrsz);
+		for (i = 0; i < ctx->nscns; i++)
+			memcpy((Elf64_Shdr *)shdrs + i, &ctx->scns[i].shdr,
+			    shdrsz);
+		ehdr = &ctx->ehdr;
+		ehdrsz = sizeof(Elf64_Ehdr);
+	}
+	obj_pwrite(ctx, ELF_T_SHDR, shdrs, ctx->nscns * shdrsz, off);
+
+	for (i = 1; i < ctx->nscns; i++) {
+		scn = &ctx->scns[i];
+		if (scn->dirtyhi <= scn->dirtylo)
+			continue;
+		lo = scn->dirtylo;
+		hi = scn->dirtyhi;
+		if (ctx->e != NULL) {
+			/* Only whole entries can be converted. */
+			entsz = gelf_fsize(ctx->e, section_data_type(scn), 1,
+			    EV_CURRENT);
+			if (entsz > 1) {
+				lo = rounddown(lo, entsz);
+				hi = roundup(hi, entsz);
+			}
+		}
+		obj_pwrite(ctx, section_data_type(scn), scn->data + lo,
+		    hi - lo, scn->shdr.sh_offset + lo);
+	}
+
+	/* Queued writes complete in any order, but the header goes last. */
+	uring_flush(ctx);
+	obj_pwrite(ctx, ELF_T_EHDR, ehdr, ehdrsz, 0);
+	uring_flush(ctx);
+}
+
+/*
+ * Prepare to write the object. Objects are opened read-only, so that those
+ * which need no changes can be processed without write access. By default the
+ * object is reopened for writing and modified in place. With -S, a temporary
+ * file is created next to the object, filled with a copy of the input if
+ * "copy" is set, and written instead; obj_write_end() then renames it over
+ * the object, so that an interrupted run leaves either the old or the new
+ * object behind, never a partially written one. The temporary file is not
+ * synced, so this does not protect against a system crash.
+ */
+static void
+obj_write_begin(struct objctx *ctx, bool copy)
+{
+	struct stat sb;
+	char *path, *tmppath;
+	off_t inoff, outoff;
+	ssize_t n;
+	size_t len;
+	int fd;
+
+	if (!ctx->atomic) {
+		if ((ctx->outfd = open(ctx->path, O_RDWR | O_CLOEXEC)) < 0)
+			objerr(ctx, "failed to open %s for writing", ctx->path);
+		if (fstat(ctx->outfd, &sb) != 0)
+			objerr(ctx, "failed to stat %s", ctx->path);
+		if (sb.st_dev != ctx->sb.st_dev || sb.st_ino != ctx->sb.st_ino)
+			objerrx(ctx, "%s was replaced while being processed",
+			    ctx->path);
+		return;
+	}
+
+	/*
+	 * Renaming over a symbolic link would replace the link rather than the
+	 * object, so the file it points to is replaced instead. The other
+	 * names of an object with hard links cannot be kept.
+	 */
+	if (ctx->sb.st_nlink > 1)
+		objerrx(ctx, "%s has %ju links, cannot replace it with -S",
+		    ctx->path, (uintmax_t)ctx->sb.st_nlink);
+	if ((path = realpath(ctx->path, NULL)) == NULL)
+		objerr(ctx, "failed to resolve %s", ctx->path);
+	len = strlen(path) + 1;
+	ctx->target = arena_alloc(&ctx->arena, len);
+	memcpy(ctx->target, path, len);
+	free(path);
+
+	len = strlen(ctx->target) + sizeof(".XXXXXX");
+	tmppath = arena_alloc(&ctx->arena, len);
+	(void)snprintf(tmppath, len, "%s.XXXXXX", ctx->target);
+	if ((fd = mkstemp(tmppath)) < 0)
+		objerr(ctx, "failed to create %s", tmppath);
+	ctx->tmppath = tmppath;
+	ctx->outfd = fd;
+
+	/* Only privileged users can give the file to its original owner. */
+	(void)fchown(fd, ctx->sb.st_uid, ctx->sb.st_gid);
+	if (fchmod(fd, ctx->sb.st_mode & ALLPERMS) != 0)
+		objerr(ctx, "failed to set the mode of %s", tmppath);
+
+	if (!copy)
+		return;
+	inoff = outoff = 0;
+	while (outoff < ctx->sb.st_size) {
+		n = copy_file_range(ctx->fd, &inoff, fd, &outoff,
+		    ctx->sb.st_size - outoff, 0);
+		if (n < 0)
+			objerr(ctx, "failed to copy %s", ctx->path);
+		if (n == 0)
+			objerrx(ctx, "%s: unexpected end of file", ctx->path);
+	}
+}
+
+/*
+ * Finish writing the object: restore its access and modification times if -p
+ * was specified, and move the temporary file created by obj_write_begin() into
+ * place.
+ */
+static void
+obj_write_end(struct objctx *ctx)
+{
+	struct timespec ts[2];
+
+	if (ctx->keeptimes) {
+		ts[0] = ctx->sb.st_atim;
+		ts[1] = ctx->sb.st_mtim;
+		if (futimens(ctx->outfd, ts) != 0)
+			objerr(ctx, "failed to set the times of %s", ctx->path);
+	}
+	if (ctx->tmppath != NULL) {
+		if (rename(ctx->tmppath, ctx->target) != 0)
+			objerr(ctx, "failed to rename %s to %s", ctx->tmppath,
+			    ctx->target);
+		ctx->tmppath = NULL;
+	}
+}
+
+/*
+ * Return the string at offset off in the specified string table, including
+ * strings appended while processing the object, or NULL if the offset is
+ * invalid.
+ */
+static const char *
+objstr(struct objctx *ctx, size_t ndx, size_t off)
+{
+	struct objscn *scn;
+	struct secbuf *sb;
+
+	if (ndx >= ctx->nscns)
+		return (NULL);
+	scn = &ctx->scns[ndx];
+	if (off < scn->datasz)
+		return (scn->data[scn->datasz - 1] == '\0' ?
+		    (const char *)scn->data + off : NULL);
+	sb = scn->sb;
+	if (sb != NULL && off >= sb->base && off - sb->base < sb->len)
+		return ((const char *)sb->buf + (off - sb->base));
+	return (NULL);
+}
+
+/* Report a fatal error for an object; see the description of struct objctx. */
+static void
+objerr(struct objctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	objverr(ctx, errno, fmt, ap);
+}
+
+static void
+objerrx(struct objctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	objverr(ctx, -1, fmt, ap);
+}
+
+static void
+objverr(struct objctx *ctx, int code, const char *fmt, va_list ap)
+{
+	FILE *fp;
+	size_t len;
+
+	if (ctx->shard != NULL) {
+		/* The error is reported once the shards have been merged. */
+		(void)vsnprintf(ctx->shard->errmsg, sizeof(ctx->shard->errmsg),
+		    fmt, ap);
+		len = strlen(ctx->shard->errmsg);
+		if (code != -1)
+			(void)snprintf(ctx->shard->errmsg + len,
+			    sizeof(ctx->shard->errmsg) - len, ": %s",
+			    strerror(code));
+		va_end(ap);
+		longjmp(ctx->errjmp, 1);
+	}
+
+	/* Don't leave a partially written temporary file behind. */
+	if (ctx->tmppath != NULL) {
+		(void)unlink(ctx->tmppath);
+		ctx->tmppath = NULL;
+	}
+
+	if (!ctx->recover) {
+		if (code == -1)
+			verrx(1, fmt, ap);
+		verrc(1, code, fmt, ap);
+	}
+
+	fp = ctx->diag != NULL ? ctx->diag : stderr;
+	fprintf(fp, "%s: ", getprogname());
+	vfprintf(fp, fmt, ap);
+	if (code != -1)
+		fprintf(fp, ": %s", strerror(code));
+	fputc('\n', fp);
+	va_end(ap);
+
+	longjmp(ctx->errjmp, 1);
+}
+
+/*
+ * Emit a diagnostic for the object being processed. In serial mode this is
+ * just warnx(3); workers instead buffer their output so that the main thread
+ * can emit it in input order.
+ */
+static void
+objwarnx(struct objctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (ctx->diag == NULL) {
+		vwarnx(fmt, ap);
+	} else {
+		fprintf(ctx->diag, "%s: ", getprogname());
+		vfprintf(ctx->diag, fmt, ap);
+		fputc('\n', ctx->diag);
+	}
+	va_end(ap);
+}
+
+/* Order objects by decreasing size, breaking ties using the input order. */
+static int
+objsize_cmp(const void *a, const void *b)
+{
+	const struct objctx *obj1, *obj2;
+
+	obj1 = *(struct objctx * const *)a;
+	obj2 = *(struct objctx * const *)b;
+	if (obj1->size != obj2->size)
+		return (obj1->size > obj2->size ? -1 : 1);
+	return (obj1 < obj2 ? -1 : obj1 > obj2);
+}
+
+/* Return the number of online CPUs. */
+static u_int
+online_cpus(void)
+{
+	long ncpu;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	return (MIN(ncpu, UINT_MAX));
+}
+
+static void
+pathlist_add(struct pathlist *pl, const char *path)
+{
+
+	if (pl->count == pl->cap) {
+		pl->cap = pl->cap == 0 ? 64 : pl->cap * 2;
+		pl->paths = realloc(pl->paths, pl->cap * sizeof(*pl->paths));
+		if (pl->paths == NULL)
+			err(1, "realloc");
+	}
+	if ((pl->paths[pl->count++] = strdup(path)) == NULL)
+		err(1, "strdup");
+}
+
+static void
+pathlist_free(struct pathlist *pl)
+{
+
+	for (size_t i = 0; i < pl->count; i++)
+		free(pl->paths[i]);
+	free(pl->paths);
+}
+
+/*
+ * Add the object paths listed in a file, or on standard input if the file name
+ * is "-". Paths are separated by delim, which is either a newline or a NUL
+ * character; empty entries are ignored.
+ */
+static void
+pathlist_read(struct pathlist *pl, const char *file, int delim)
+{
+	FILE *fp;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(file, "r")) == NULL)
+		err(1, "failed to open %s", file);
+
+	if (pathlist_readfp(pl, fp, delim) != 0)
+		err(1, "failed to read %s", fp == stdin ? "standard input" :
+		    file);
+	if (fp != stdin)
+		fclose(fp);
+}
+
+static int
+pathlist_readfp(struct pathlist *pl, FILE *fp, int delim)
+{
+	char *line;
+	size_t linecap;
+	ssize_t n;
+
+	line = NULL;
+	linecap = 0;
+	while ((n = getdelim(&line, &linecap, delim, fp)) > 0) {
+		if (line[n - 1] == delim)
+			line[--n] = '\0';
+		if (n > 0)
+			pathlist_add(pl, line);
+	}
+	free(line);
+	return (ferror(fp) ? -1 : 0);
+}
+
+static void
+perf_close(int *fds)
+{
+
+	for (int i = NCOUNTERS - 1; i >= 0; i--) {
+		if (fds[i] >= 0)
+			(void)close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+/*
+ * Open a group of hardware counters measuring the calling thread, with the
+ * cycle counter as the group leader. Returns 0 on success; otherwise errno is
+ * set and all of fds are -1.
+ */
+static int
+perf_open(int *fds)
+{
+#ifdef __linux__
+	static const uint64_t events[NCOUNTERS] = {
+		[COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+		[COUNTER_INSNS] = PERF_COUNT_HW_INSTRUCTIONS,
+		[COUNTER_CMISS] = PERF_COUNT_HW_CACHE_MISSES,
+		[COUNTER_BMISS] = PERF_COUNT_HW_BRANCH_MISSES,
+	};
+	struct perf_event_attr attr;
+	int error, i;
+
+	for (i = 0; i < NCOUNTERS; i++)
+		fds[i] = -1;
+	for (i = 0; i < NCOUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = events[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+		    i == 0 ? -1 : fds[0], 0);
+		if (fds[i] < 0) {
+			error = errno;
+			perf_close(fds);
+			errno = error;
+			return (-1);
+		}
+	}
+	return (0);
+#else
+	for (int i = 0; i < NCOUNTERS; i++)
+		fds[i] = -1;
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+static bool
+perf_read(const int *fds, uint64_t *vals)
+{
+	uint64_t buf[1 + NCOUNTERS];
+
+	if (fds[0] < 0 || read(fds[0], buf, sizeof(buf)) != sizeof(buf) ||
+	    buf[0] != NCOUNTERS)
+		return (false);
+	memcpy(vals, &buf[1], NCOUNTERS * sizeof(*vals));
+	return (true);
+}
+
+/*
+ * Check the first n bytes of an object, read by the prefilter, for an ELF
+ * header of a relocatable object in the host byte order, and return the
+ * location and layout of its section header table. Returns false if the
+ * object is to be left to the full processing path.
+ */
+static bool
+prefilter_ehdr(const void *buf, ssize_t n, uint64_t *shoff, size_t *shnum,
+    size_t *shentsz)
+{
+	union {
+		Elf32_Ehdr	e32;
+		Elf64_Ehdr	e64;
+	} ehdr;
+
+	if (n < EI_NIDENT)
+		return (false);
+	memcpy(&ehdr, buf, MIN((size_t)n, sizeof(ehdr)));
+	if (memcmp(ehdr.e64.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr.e64.e_ident[EI_DATA] != ELFDATA_HOST)
+		return (false);
+	switch (ehdr.e64.e_ident[EI_CLASS]) {
+	case ELFCLASS32:
+		if ((size_t)n < sizeof(ehdr.e32) || ehdr.e32.e_type != ET_REL)
+			return (false);
+		*shoff = ehdr.e32.e_shoff;
+		*shnum = ehdr.e32.e_shnum;
+		*shentsz = ehdr.e32.e_shentsize;
+		if (*shentsz != sizeof(Elf32_Shdr))
+			return (false);
+		break;
+	case ELFCLASS64:
+		if ((size_t)n < sizeof(ehdr.e64) || ehdr.e64.e_type != ET_REL)
+			return (false);
+		*shoff = ehdr.e64.e_shoff;
+		*shnum = ehdr.e64.e_shnum;
+		*shentsz = ehdr.e64.e_shentsize;
+		if (*shentsz != sizeof(Elf64_Shdr))
+			return (false);
+		break;
+	default:
+		return (false);
+	}
+	/* No sections, or extended section numbering. */
+	return (*shoff != 0 && *shnum != 0);
+}
+
+/*
+ * Look at section i in a section header table read by the prefilter. If it is
+ * a symbol table, return 1 and the location of its string table. Returns 0 for
+ * other sections, and -1 if the string table is invalid, in which case the
+ * object is left to the full processing path.
+ */
+static int
+prefilter_strtab(const uint8_t *shdrs, size_t shnum, size_t shentsz, size_t i,
+    uint64_t *off, uint64_t *size)
+{
+	union {
+		Elf32_Shdr	s32;
+		Elf64_Shdr	s64;
+	} shdr;
+	size_t link;
+
+	memcpy(&shdr, shdrs + i * shentsz, shentsz);
+	if (shentsz == sizeof(Elf32_Shdr)) {
+		if (shdr.s32.sh_type != SHT_SYMTAB)
+			return (0);
+		link = shdr.s32.sh_link;
+	} else {
+		if (shdr.s64.sh_type != SHT_SYMTAB)
+			return (0);
+		link = shdr.s64.sh_link;
+	}
+	if (link >= shnum)
+		return (-1);
+
+	memcpy(&shdr, shdrs + link * shentsz, shentsz);
+	if (shentsz == sizeof(Elf32_Shdr)) {
+		*off = shdr.s32.sh_offset;
+		*size = shdr.s32.sh_size;
+	} else {
+		*off = shdr.s64.sh_offset;
+		*size = shdr.s64.sh_size;
+	}
+	return (1);
+}
+
+/*
+ * Return true if the probe prefix occurs anywhere in the buffer. Candidate
+ * positions are found by comparing two of the prefix's characters against
+ * sixteen consecutive positions at a time; only positions where both match are
+ * compared in full.
+ */
+static bool
+prefix_search(const char *buf, size_t len)
+{
+	const size_t plen = sizeof(probe_prefix) - 1;
+	size_t i;
+#ifdef __SSE2__
+	__m128i b1, b2, c1, c2;
+	u_int mask;
+	int bit;
+
+	c1 = _mm_set1_epi8(probe_prefix[PROBE_PREFIX_C1]);
+	c2 = _mm_set1_epi8(probe_prefix[PROBE_PREFIX_C2]);
+	for (i = 0; i + 15 + plen <= len; i += 16) {
+		b1 = _mm_loadu_si128((const __m128i *)(const void *)
+		    (buf + i + PROBE_PREFIX_C1));
+		b2 = _mm_loadu_si128((const __m128i *)(const void *)
+		    (buf + i + PROBE_PREFIX_C2));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b1, c1),
+		    _mm_cmpeq_epi8(b2, c2)));
+		for (; mask != 0; mask &= mask - 1) {
+			bit = ffs(mask) - 1;
+			if (memcmp(buf + i + bit, probe_prefix, plen) == 0)
+				return (true);
+		}
+	}
+#else
+	i = 0;
+#endif
+	for (; i + plen <= len; i++)
+		if (buf[i + PROBE_PREFIX_C1] == probe_prefix[PROBE_PREFIX_C1] &&
+		    memcmp(buf + i, probe_prefix, plen) == 0)
+			return (true);
+	return (false);
+}
+
+/*
+ * Intern a probe name, returning the probe's index in the object's probe
+ * table. symname points into the object's string table and is not copied.
+ */
+static size_t
+probe_intern(struct objctx *ctx, const char *symname)
+{
+	struct probe *probe;
+	uint64_t ndx;
+
+	if (symname_lookup(&ctx->probenames, symname, &ndx))
+		return (ndx);
+
+	if (ctx->nprobes == ctx->probecap) {
+		ctx->probes = arena_realloc(&ctx->arena, ctx->probes,
+		    ctx->probecap * sizeof(*ctx->probes),
+		    (ctx->probecap == 0 ? 16 : ctx->probecap * 2) *
+		    sizeof(*ctx->probes));
+		ctx->probecap = ctx->probecap == 0 ? 16 : ctx->probecap * 2;
+	}
+	probe = &ctx->probes[ctx->nprobes];
+	probe->symname = symname;
+	probe->objndx = 0;
+	probe->resolved = false;
+	symname_add(&ctx->arena, &ctx->probenames, symname, ctx->nprobes);
+	return (ctx->nprobes++);
+}
+
+/*
+ * Cheaply determine whether an object might contain probe sites, reading only
+ * the ELF header, the section headers and the symbol string tables. If none of
+ * the string tables contains the probe prefix, no relocation can refer to a
+ * probe stub and the object can be skipped. Whenever something unexpected is
+ * encountered we return true and leave it to the full processing path to deal
+ * with, so this never rejects an object that would otherwise be modified or
+ * diagnosed.
+ */
+static bool
+probe_prefilter(struct objctx *ctx)
+{
+	uint8_t ehdr[sizeof(Elf64_Ehdr)], *shdrs;
+	char *strtab;
+	uint64_t shoff, stroff, strsz;
+	size_t i, shentsz, shnum;
+	bool found;
+
+	if (!prefilter_ehdr(ehdr, pread(ctx->fd, ehdr, sizeof(ehdr), 0), &shoff,
+	    &shnum, &shentsz))
+		return (true);
+
+	shdrs = xmalloc(shnum * shentsz);
+	if (pread(ctx->fd, shdrs, shnum * shentsz, shoff) !=
+	    (ssize_t)(shnum * shentsz)) {
+		free(shdrs);
+		return (true);
+	}
+
+	found = false;
+	for (i = 0; i < shnum && !found; i++) {
+		switch (prefilter_strtab(shdrs, shnum, shentsz, i, &stroff,
+		    &strsz)) {
+		case 0:
+			continue;
+		case -1:
+			found = true;
+			continue;
+		}
+		if (strsz > SIZE_MAX || (strtab = malloc(strsz)) == NULL) {
+			found = true;
+			break;
+		}
+		if (pread(ctx->fd, strtab, strsz, stroff) != (ssize_t)strsz)
+			found = true;
+		else
+			found = prefix_search(strtab, strsz);
+		free(strtab);
+	}
+	free(shdrs);
+	return (found);
+}
+
+/*
+ * Return a bitmap of the indices of the symbols in the specified symbol table
+ * whose names begin with the probe prefix, building it on first use. This lets
+ * the relocation scan reject relocations against other symbols without looking
+ * up their names. Symbols whose names can't be found are included, so that
+ * process_reloc() reports them.
+ */
+static const uint64_t *
+probemap_get(struct objctx *ctx, size_t symndx)
+{
+	size_t sz;
+
+	if (ctx->probemap != NULL && ctx->probemapndx == symndx)
+		return (ctx->probemap);
+
+	sz = howmany(symbol_count(ctx, symndx), 64) * sizeof(uint64_t);
+	ctx->probemap = arena_alloc(&ctx->arena, sz);
+	ctx->probemapndx = symndx;
+	memset(ctx->probemap, 0, sz);
+	CLASS_DISPATCH(ctx, probemap_scan, ctx, symndx, ctx->probemap);
+	return (ctx->probemap);
+}
+
+static __always_inline void
+probemap_scan(struct objctx *ctx, size_t symndx, uint64_t *map, int class)
+{
+	GElf_Sym sym;
+	const uint8_t *data;
+	const char *symname;
+	size_t i, nsyms, strndx;
+
+	data = ctx->scns[symndx].data;
+	nsyms = symbol_count(ctx, symndx);
+	strndx = ctx->scns[symndx].shdr.sh_link;
+	for (i = 1; i < nsyms; i++) {
+		symbol_load(data, i, &sym, class);
+		symname = objstr(ctx, strndx, sym.st_name);
+		if (symname == NULL || strncmp(symname, probe_prefix,
+		    sizeof(probe_prefix) - 1) == 0)
+			map[i / 64] |= 1ULL << (i % 64);
+	}
+}
+
+/*
+ * Look up the symbol for a probe's sdt_probe object, adding an undefined symbol
+ * if the object isn't referenced in this object file. This is done once per
+ * probe, when its first instance is recorded.
+ */
+static void
+probe_resolve(struct objctx *ctx, struct probe *probe)
+{
+	Elf64_Sym sym64;
+	Elf32_Sym sym32;
+	char *probeobjname;
+	void *sym;
+	size_t nameoff, namesz, symsz;
+	uint64_t probeobjndx;
+	int phase;
+	bool found;
+
+	/*
+	 * If the probe name is "__dtrace_probe_<foo>", the probe object name is
+	 * "sdt_<foo>".
+	 */
+	namesz = strlen(sdtobj_prefix) + strlen(probe->symname) -
+	    strlen(probe_prefix) + 1;
+	probeobjname = arena_alloc(&ctx->arena, namesz);
+	(void)strlcpy(probeobjname, sdtobj_prefix, namesz);
+	(void)strlcat(probeobjname, probe->symname + strlen(probe_prefix),
+	    namesz);
+
+	phase = stats_nest(ctx, PHASE_SYMBOLS);
+	found = symbol_by_name(ctx, probeobjname, &probeobjndx) != 0;
+	(void)stats_nest(ctx, phase);
+	if (!found) {
+		nameoff = secbuf_append(&ctx->strbuf, probeobjname,
+		    strlen(probeobjname) + 1);
+
+		switch (ctx->class) {
+		case ELFCLASS32:
+			memset(&sym32, 0, sizeof(sym32));
+			sym32.st_name = nameoff;
+			sym32.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+			symsz = sizeof(sym32);
+			sym = &sym32;
+			break;
+		case ELFCLASS64:
+			memset(&sym64, 0, sizeof(sym64));
+			sym64.st_name = nameoff;
+			sym64.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+			symsz = sizeof(sym64);
+			sym = &sym64;
+			break;
+		default:
+			objerrx(ctx, "unexpected ELF class %d", ctx->class);
+		}
+		probeobjndx = secbuf_append(&ctx->symbuf, sym, symsz) / symsz;
+		symname_add(&ctx->arena, &ctx->symnames, probeobjname,
+		    probeobjndx);
+		LOG(ctx, "added probe object symbol '%s'", probeobjname);
+	}
+
+	probe->objndx = probeobjndx;
+	probe->resolved = true;
+}
+
+static int
+process_reloc(struct objctx *ctx, size_t symndx, size_t targndx,
+    GElf_Addr offset, GElf_Xword *info)
+{
+	GElf_Sym sym;
+	struct functab *ftab;
+	struct probe_instance *inst;
+	const char *symname;
+	Elf64_Xword nulrel;
+	uint64_t funcaddr, funcndx;
+	uint8_t *target;
+	size_t targsz;
+	uint8_t opc;
+	int phase;
+
+	(void)symbol_by_index(ctx, symndx, GELF_R_SYM(*info), &sym);
+	symname = objstr(ctx, ctx->scns[symndx].shdr.sh_link, sym.st_name);
+	if (symname == NULL)
+		objerrx(ctx, "couldn't find symbol name for relocation");
+
+	if (strncmp(symname, probe_prefix, sizeof(probe_prefix) - 1) != 0)
+		/* We're not interested in this relocation. */
+		return (1);
+
+	/* Sanity checks. */
+	if (GELF_ST_TYPE(sym.st_info) != STT_NOTYPE)
+		objerrx(ctx, "unexpected symbol type %d for %s",
+		    GELF_ST_TYPE(sym.st_info), symname);
+	if (GELF_ST_BIND(sym.st_info) != STB_GLOBAL)
+		objerrx(ctx, "unexpected binding %d for %s",
+		    GELF_ST_BIND(sym.st_info), symname);
+
+	target = ctx->scns[targndx].data;
+	targsz = ctx->scns[targndx].datasz;
+
+	switch (ctx->ehdr.e_machine) {
+	case EM_X86_64:
+		/* Sanity checks. */
+		if (GELF_R_TYPE(*info) != R_X86_64_64 &&
+		    GELF_R_TYPE(*info) != R_X86_64_PC32) {
+			if (GELF_R_TYPE(*info) != R_X86_64_NONE)
+				objerrx(ctx,
+			    "unexpected relocation type 0x%lx against %s",
+				    GELF_R_TYPE(*info), symname);
+			/* We've presumably already processed this file. */
+			return (1);
+		}
+		if (offset < 1 || targsz < 4 || offset > targsz - 4)
+			objerrx(ctx, "invalid offset 0x%lx for %s", offset,
+			    symname);
+		opc = target[offset - 1];
+		if (opc != AMD64_CALL && opc != AMD64_JMP32)
+			objerrx(ctx,
+			    "unexpected opcode 0x%x for %s at offset 0x%lx",
+			    opc, symname, offset);
+
+		if (target[offset + 0] != 0 ||
+		    target[offset + 1] != 0 ||
+		    target[offset + 2] != 0 ||
+		    target[offset + 3] != 0)
+			objerrx(ctx, "unexpected addr for %s at offset 0x%lx",
+			    symname, offset);
+
+		/*
+		 * Overwrite the call with NOPs. If this was a tail call, we
+		 * need to return instead.
+		 */
+		memcpy(&target[offset - 1], opc == AMD64_CALL ?
+		    ctx->nops->call : ctx->nops->jmp, AMD64_SITESZ);
+
+		mark_dirty(ctx, targndx, offset - 1, AMD64_SITESZ);
+		nulrel = R_X86_64_NONE;
+		break;
+	default:
+		objerrx(ctx, "unhandled machine type 0x%x",
+		    ctx->ehdr.e_machine);
+	}
+
+	/* Make sure the linker ignores this relocation. */
+	*info = GELF_R_INFO(0UL, nulrel);
+
+	LOG(ctx, "updated relocation for %s at 0x%lx", symname, offset - 1);
+
+	phase = stats_nest(ctx, PHASE_SYMBOLS);
+	ftab = functab_get(ctx, symndx, targndx);
+	if (symbol_by_offset(ftab, offset, &funcaddr, &funcndx) != 1)
+		objerrx(ctx, "failed to look up function for probe %s",
+		    symname);
+	(void)stats_nest(ctx, phase);
+
+	if (ctx->ninsts == ctx->instcap) {
+		ctx->insts = arena_realloc(&ctx->arena, ctx->insts,
+		    ctx->instcap * sizeof(*ctx->insts),
+		    (ctx->instcap == 0 ? 64 : ctx->instcap * 2) *
+		    sizeof(*ctx->insts));
+		ctx->instcap = ctx->instcap == 0 ? 64 : ctx->instcap * 2;
+	}
+	inst = &ctx->insts[ctx->ninsts++];
+	inst->probe = probe_intern(ctx, symname);
+	inst->symndx = funcndx;
+	inst->offset = offset - funcaddr;
+
+	return (0);
+}
+
+/*
+ * Look for relocations against DTrace probe stubs. Such relocations are used to
+ * populate the probe instance array (insts) and then invalidated, since we
+ * overwrite the call site with NOPs.
+ */
+static void
+process_reloc_section(struct objctx *ctx, size_t relndx)
+{
+	const uint64_t *map;
+	const char *name;
+	size_t nrels, symndx, targndx;
+
+	targndx = ctx->scns[relndx].shdr.sh_info;
+	symndx = ctx->scns[relndx].shdr.sh_link;
+	if (targndx == SHN_UNDEF || targndx >= ctx->nscns)
+		objerrx(ctx, "failed to look up relocation section");
+
+	/* We only want to process relocations against the text section. */
+	name = get_section_name(ctx, targndx);
+	if (strcmp(name, ".text") != 0) {
+		LOG(ctx, "skipping relocation section for %s", name);
+		return;
+	}
+
+	if (symndx == SHN_UNDEF || symndx >= ctx->nscns)
+		objerrx(ctx, "failed to look up symbol table");
+
+	nrels = reloc_count(ctx, relndx);
+	ctx->stats.relocs += nrels;
+	map = probemap_get(ctx, symndx);
+	if (!reloc_shards(ctx, relndx, symndx, targndx, map, nrels))
+		CLASS_DISPATCH(ctx, reloc_scan, ctx, relndx, symndx, targndx,
+		    map, 0, nrels);
+}
+
+/*
+ * Process an input object file. This function choreographs the work done by
+ * sdtpatch: it first processes all the relocations against the DTrace probe
+ * stubs and uses the information from those relocations to build up an array
+ * (insts) of probe sites. It then adds information about each probe site to the
+ * object file, later used by the SDT kernel module to actually create DTrace
+ * probes.
+ */
+static void
+process_obj(struct objctx *ctx)
+{
+	const char *obj;
+	size_t i, cnt, datandx, datarelndx, strsz, symndx, symsz;
+
+	obj = ctx->path;
+
+	LIST_INIT(&ctx->arena);
+	ctx->probemap = NULL;
+	ctx->probes = NULL;
+	ctx->nprobes = ctx->probecap = 0;
+	memset(&ctx->probenames, 0, sizeof(ctx->probenames));
+	memset(&ctx->symnames, 0, sizeof(ctx->symnames));
+	ctx->insts = NULL;
+	ctx->ninsts = ctx->instcap = 0;
+	SLIST_INIT(&ctx->functabs);
+	ctx->tmppath = NULL;
+	ctx->haskey = false;
+	ctx->writes = NULL;
+	ctx->nwrites = 0;
+	stats_begin(ctx);
+
+	if (ctx->recover && setjmp(ctx->errjmp) != 0) {
+		ctx->failed = true;
+		ctx->stats.result = RESULT_FAILED;
+		goto out;
+	}
+
+	/* The object may have been opened by uring_prefilter(). */
+	if (ctx->fd < 0) {
+		if ((ctx->fd = open(obj, O_RDONLY)) < 0)
+			objerr(ctx, "failed to open %s", obj);
+		if (fstat(ctx->fd, &ctx->sb) != 0)
+			objerr(ctx, "failed to stat %s", obj);
+	}
+	ctx->stats.size = ctx->sb.st_size;
+
+	if (ctx->prefiltered ? !ctx->maybeprobes : !probe_prefilter(ctx)) {
+		LOG(ctx, "no probes found in %s", obj);
+		goto out;
+	}
+
+	if (ctx->cache != NULL && cache_lookup(ctx)) {
+		ctx->stats.result = RESULT_CACHED;
+		goto out;
+	}
+
+	if (obj_open(ctx) != 0)
+		goto out;
+
+	/* Hijack relocations for DTrace probe stub calls. */
+
+	stats_phase(ctx, PHASE_SCAN);
+
+	for (i = 0; i < ctx->nrelscns; i++)
+		process_reloc_section(ctx, ctx->relscns[i]);
+
+	if (ctx->ninsts == 0) {
+		/* No probe instances in this object file, we're done. */
+		LOG(ctx, "no probes found in %s", obj);
+		ctx->stats.result = RESULT_NOPROBES;
+		if (ctx->cache != NULL)
+			cache_store(ctx, false);
+		goto out;
+	}
+
+	/* Now record all of the instance sites. */
+
+	stats_phase(ctx, PHASE_SYMBOLS);
+
+	if ((symndx = ctx->symtabndx) == SHN_UNDEF)
+		objerrx(ctx, "couldn't find symbol table in %s", obj);
+	if (ctx->scns[symndx].shdr.sh_link >= ctx->nscns)
+		objerrx(ctx, "failed to find string table for %s",
+		    get_section_name(ctx, symndx));
+	symname_init(ctx, symndx);
+	stats_phase(ctx, PHASE_RECORD);
+
+	if ((datandx = section_by_name(ctx, ".data")) == SHN_UNDEF)
+		objerrx(ctx, "couldn't find data section in %s", obj);
+
+	/*
+	 * Size the section builders so that, in the common case, each of them
+	 * needs a single allocation. Every instance needs a data object, two
+	 * data relocations, a linker set relocation and a symbol, and each
+	 * probe may need a symbol for its probe object; each symbol needs a
+	 * name.
+	 */
+	cnt = ctx->ninsts;
+	strsz = 32 * cnt;
+	for (i = 0; i < ctx->nprobes; i++)
+		strsz += strlen(ctx->probes[i].symname) + 1;
+	symsz = ctx->class == ELFCLASS32 ? sizeof(Elf32_Sym) :
+	    sizeof(Elf64_Sym);
+
+	secbuf_init(ctx, &ctx->shstrbuf, ctx->shstrndx, 128);
+	secbuf_init(ctx, &ctx->strbuf, ctx->scns[symndx].shdr.sh_link,
+	    strsz + 64);
+	secbuf_init(ctx, &ctx->symbuf, symndx,
+	    (cnt + ctx->nprobes + 2) * symsz);
+	secbuf_init(ctx, &ctx->databuf, datandx,
+	    cnt * sizeof(struct sdt_instance));
+
+	datarelndx = get_reloc_section(ctx, datandx, symndx);
+	if (datarelndx == SHN_UNDEF) {
+		/*
+		 * The object file doesn't have any relocations against the data
+		 * section, so we have to create a relocation section ourselves.
+		 */
+		LOG(ctx, "adding data relocation section for %s", obj);
+		datarelndx = add_reloc_section(ctx, datandx, symndx);
+	}
+	secbuf_init(ctx, &ctx->datarelbuf, datarelndx,
+	    2 * cnt * sizeof(Elf64_Rela));
+
+	init_new_sections(ctx, symndx, cnt);
+
+	for (i = 0; i < cnt; i++)
+		record_instance(ctx, &ctx->insts[i], i);
+
+	secbuf_finish(ctx, &ctx->shstrbuf);
+	secbuf_finish(ctx, &ctx->strbuf);
+	secbuf_finish(ctx, &ctx->symbuf);
+	secbuf_finish(ctx, &ctx->databuf);
+	secbuf_finish(ctx, &ctx->datarelbuf);
+	secbuf_finish(ctx, &ctx->instbuf);
+	secbuf_finish(ctx, &ctx->instrelbuf);
+
+	ctx->stats.probes = cnt;
+	ctx->stats.appended[0] = ctx->shstrbuf.len;
+	ctx->stats.appended[1] = ctx->strbuf.len;
+	ctx->stats.appended[2] = ctx->symbuf.len;
+	ctx->stats.appended[3] = ctx->databuf.len;
+	ctx->stats.appended[4] = ctx->datarelbuf.len;
+	ctx->stats.appended[5] = ctx->instbuf.len;
+	ctx->stats.appended[6] = ctx->instrelbuf.len;
+
+	stats_phase(ctx, PHASE_WRITE);
+	obj_write_begin(ctx, true);
+	obj_write(ctx);
+	obj_write_end(ctx);
+	ctx->stats.result = RESULT_PATCHED;
+	stats_phase(ctx, PHASE_OTHER);
+	if (ctx->cache != NULL)
+		cache_store(ctx, true);
+
+out:
+	obj_close(ctx);
+	ctx->prefiltered = false;
+
+	/* libelf references the builder buffers until elf_end() is called. */
+	arena_free(&ctx->arena);
+	stats_end(ctx);
+}
+
+/* Write out a buffer at the specified file offset. */
+static void
+pwrite_all(struct objctx *ctx, const void *buf, size_t len, off_t off)
+{
+	const char *p;
+	ssize_t n;
+
+	for (p = buf; len > 0; p += n, off += n, len -= n)
+		if ((n = pwrite(ctx->outfd, p, len, off)) < 0)
+			objerr(ctx, "failed to write %s", ctx->path);
+}
+
+/*
+ * Add a probe instance to the target ELF file. This consists of several steps:
+ * - add space for a struct sdt_instance to the data section,
+ * - add a symbol table entry for the instance,
+ * - add a relocation for the probe field of the struct sdt_instance,
+ * - add a relocation for the offset field of the struct sdt_instance,
+ * - add a relocation for the probe instance linker set.
+ */
+static void
+record_instance(struct objctx *ctx, const struct probe_instance *inst,
+    size_t ndx)
+{
+	struct probe *probe;
+	struct sdt_instance sdtinst;
+	Elf64_Rela rela;
+	Elf64_Sym sym64;
+	Elf32_Sym sym32;
+	char namebuf[64], *instsymname;
+	void *sym;
+	size_t instoff, nameoff, relsz, symsz;
+	uint64_t instndx;
+
+	probe = &ctx->probes[inst->probe];
+
+	/* Filled in using relocations generated in steps 3 & 4. */
+	memset(&sdtinst, 0, sizeof(sdtinst));
+
+	/*
+	 * Step 1: install the probe instance into the data section.
+	 */
+
+	instoff = secbuf_append(&ctx->databuf, &sdtinst, sizeof(sdtinst));
+	LOG(ctx, "created probe instance for '%s' at offset %zu", probe->symname,
+	    instoff);
+
+	/*
+	 * Step 2: add a symbol table entry for the probe instance object.
+	 */
+
+	/*
+	 * Step 2.1: create a unique name for the symbol and add it to the
+	 * string table.
+	 */
+	(void)snprintf(namebuf, sizeof(namebuf), "%s%zu.%ld", sdtinst_prefix,
+	    ndx, obj_key(ctx));
+	instsymname = arena_strdup(&ctx->arena, namebuf);
+
+	nameoff = secbuf_append(&ctx->strbuf, instsymname,
+	    strlen(instsymname) + 1);
+
+	/*
+	 * Step 2.2: create the symbol table entry and add it to the table.
+	 */
+	switch (ctx->class) {
+	case ELFCLASS32:
+		sym32.st_name = nameoff;
+		sym32.st_value = instoff;
+		sym32.st_size = sizeof(sdtinst); /* XXX cross-compat... */
+		sym32.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT);
+		sym32.st_other = 0;
+		sym32.st_shndx = ctx->databuf.ndx;
+
+		symsz = sizeof(sym32);
+		sym = &sym32;
+		break;
+	case ELFCLASS64:
+		sym64.st_name = nameoff;
+		sym64.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
+		sym64.st_other = 0;
+		sym64.st_shndx = ctx->databuf.ndx;
+		sym64.st_value = instoff;
+		sym64.st_size = sizeof(sdtinst); /* XXX cross-compat... */
+
+		symsz = sizeof(sym64);
+		sym = &sym64;
+		break;
+	default:
+		objerrx(ctx, "unexpected ELF class %d", ctx->class);
+	}
+
+	instndx = secbuf_append(&ctx->symbuf, sym, symsz) / symsz;
+	symname_add(&ctx->arena, &ctx->symnames, instsymname, instndx);
+
+	LOG(ctx, "added symbol table entry for '%s' at index %ju",
+	    probe->symname, (uintmax_t)instndx);
+
+	/*
+	 * Step 3: add a relocation for the object we added in step 2. We need
+	 * to ensure that the instance's probe pointer is set to the
+	 * corresponding struct sdt_probe.
+	 */
+	if (!probe->resolved)
+		probe_resolve(ctx, probe);
+
+	switch (ctx->ehdr.e_machine) {
+	case EM_X86_64:
+		rela.r_offset = instoff; /* probe pointer is the first field */
+		rela.r_info = ELF64_R_INFO(probe->objndx, R_X86_64_64);
+		rela.r_addend = 0;
+
+		relsz = sizeof(rela);
+		break;
+	default:
+		objerrx(ctx, "unhandled machine type 0x%x",
+		    ctx->ehdr.e_machine);
+	}
+
+	(void)secbuf_append(&ctx->datarelbuf, &rela, relsz);
+
+	/*
+	 * Step 4: add a relocation, this time for the offset field of the
+	 * object added in step 2. The SDT code doesn't know where the text
+	 * section of a given linker file is located, so it isn't enough for us
+	 * to just provide the offset into the text section.
+	 */
+
+	switch (ctx->ehdr.e_machine) {
+	case EM_X86_64:
+		rela.r_offset = instoff + /* XXX cross-compat */
+		    __offsetof(struct sdt_instance, sdti_offset);
+		rela.r_info = ELF64_R_INFO(inst->symndx, R_X86_64_64);
+		rela.r_addend = inst->offset;
+
+		relsz = sizeof(rela);
+		break;
+	default:
+		objerrx(ctx, "unhandled machine type 0x%x",
+		    ctx->ehdr.e_machine);
+	}
+
+	(void)secbuf_append(&ctx->datarelbuf, &rela, relsz);
+
+	/*
+	 * Step 5: add a relocation for the new probe instance object (created
+	 * in step 1) to the probe instance linker set.
+	 */
+
+	switch (ctx->ehdr.e_machine) {
+	case EM_X86_64:
+		rela.r_offset = ndx * wordsize(ctx);
+		rela.r_info = ELF64_R_INFO(instndx, R_X86_64_64);
+		rela.r_addend = 0;
+
+		relsz = sizeof(rela);
+		break;
+	default:
+		objerrx(ctx, "unhandled machine type 0x%x",
+		    ctx->ehdr.e_machine);
+	}
+
+	(void)secbuf_append(&ctx->instrelbuf, &rela, relsz);
+
+	/* Fin. */
+}
+
+/*
+ * Retrieve relocation i from the specified SHT_REL or SHT_RELA section. The
+ * addend of SHT_REL relocations is reported as zero.
+ */
+static GElf_Rela *
+reloc_by_index(struct objctx *ctx, size_t relndx, size_t i, GElf_Rela *rela)
+{
+	Elf32_Rel rel32;
+	Elf32_Rela rela32;
+	Elf64_Rel rel64;
+	Elf64_Rela rela64;
+	const uint8_t *p;
+	bool isrela;
+
+	p = ctx->scns[relndx].data;
+	isrela = ctx->scns[relndx].shdr.sh_type == SHT_RELA;
+	switch (ctx->class) {
+	case ELFCLASS32:
+		if (isrela) {
+			memcpy(&rela32, p + i * sizeof(rela32), sizeof(rela32));
+			rela->r_offset = rela32.r_offset;
+			rela->r_info = GELF_R_INFO(ELF32_R_SYM(rela32.r_info),
+			    ELF32_R_TYPE(rela32.r_info));
+			rela->r_addend = rela32.r_addend;
+		} else {
+			memcpy(&rel32, p + i * sizeof(rel32), sizeof(rel32));
+			rela->r_offset = rel32.r_offset;
+			rela->r_info = GELF_R_INFO(ELF32_R_SYM(rel32.r_info),
+			    ELF32_R_TYPE(rel32.r_info));
+			rela->r_addend = 0;
+		}
+		break;
+	case ELFCLASS64:
+		if (isrela) {
+			memcpy(&rela64, p + i * sizeof(rela64), sizeof(rela64));
+			rela->r_offset = rela64.r_offset;
+			rela->r_info = rela64.r_info;
+			rela->r_addend = rela64.r_addend;
+		} else {
+			memcpy(&rel64, p + i * sizeof(rel64), sizeof(rel64));
+			rela->r_offset = rel64.r_offset;
+			rela->r_info = rel64.r_info;
+			rela->r_addend = 0;
+		}
+		break;
+	default:
+		objerrx(ctx, "unexpected ELF class %d", ctx->class);
+	}
+	return (rela);
+}
+
+/* Return the number of relocations in the specified section. */
+static size_t
+reloc_count(struct objctx *ctx, size_t relndx)
+{
+	size_t relsz;
+
+	if (ctx->class == ELFCLASS32)
+		relsz = ctx->scns[relndx].shdr.sh_type == SHT_RELA ?
+		    sizeof(Elf32_Rela) : sizeof(Elf32_Rel);
+	else
+		relsz = ctx->scns[relndx].shdr.sh_type == SHT_RELA ?
+		    sizeof(Elf64_Rela) : sizeof(Elf64_Rel);
+	return (ctx->scns[relndx].datasz / relsz);
+}
+
+/*
+ * Scan relocations [first, last) of a relocation section, passing relocations
+ * against probe symbols, or against invalid symbol indices, to process_reloc().
+ * The symbol index is read directly from each entry's r_info field, which is at
+ * the same offset in Elf_Rel and Elf_Rela, and only candidates are converted to
+ * a GElf_Rela.
+ */
+static __always_inline void
+reloc_scan(struct objctx *ctx, size_t relndx, size_t symndx, size_t targndx,
+    const uint64_t *map, size_t first, size_t last, int class)
+{
+	GElf_Rela rela;
+	const uint8_t *p;
+	uint64_t sym;
+	Elf64_Xword info64;
+	Elf32_Word info32;
+	size_t entsz, i, nsyms;
+	bool isrela;
+
+	isrela = ctx->scns[relndx].shdr.sh_type == SHT_RELA;
+	if (class == ELFCLASS32)
+		entsz = isrela ? sizeof(Elf32_Rela) : sizeof(Elf32_Rel);
+	else
+		entsz = isrela ? sizeof(Elf64_Rela) : sizeof(Elf64_Rel);
+	nsyms = symbol_count(ctx, symndx);
+
+	p = ctx->scns[relndx].data + first * entsz;
+	for (i = first; i < last; i++, p += entsz) {
+		if (class == ELFCLASS32) {
+			memcpy(&info32, p + __offsetof(Elf32_Rel, r_info),
+			    sizeof(info32));
+			sym = ELF32_R_SYM(info32);
+		} else {
+			memcpy(&info64, p + __offsetof(Elf64_Rel, r_info),
+			    sizeof(info64));
+			sym = ELF64_R_SYM(info64);
+		}
+		if (sym < nsyms && (map[sym / 64] & (1ULL << (sym % 64))) == 0)
+			continue;
+		(void)reloc_by_index(ctx, relndx, i, &rela);
+		if (process_reloc(ctx, symndx, targndx, rela.r_offset,
+		    &rela.r_info) == 0)
+			reloc_update(ctx, relndx, i, &rela);
+	}
+}
+
+/* Thread entry point for scanning one shard of a relocation section. */
+static void *
+reloc_shard_run(void *arg)
+{
+	struct relshard *sh;
+	struct objctx *ctx;
+
+	sh = arg;
+	ctx = &sh->ctx;
+	if (setjmp(ctx->errjmp) != 0) {
+		sh->failed = true;
+		return (NULL);
+	}
+	CLASS_DISPATCH(ctx, reloc_scan, ctx, sh->relndx, sh->symndx,
+	    sh->targndx, sh->map, sh->first, sh->last);
+	return (NULL);
+}
+
+/*
+ * Scan a large relocation section using several threads, if job slots are
+ * available for them. The section is split into contiguous ranges which are
+ * scanned independently, and the results are merged in order, so the output is
+ * the same as that of a serial scan. Returns false if the caller should scan
+ * the section itself. Verbose output is emitted as relocations are processed,
+ * so it disables parallel scans.
+ *
+ * This runs on a worker thread, so the slots are taken without waiting for
+ * the jobserver and without holding any lock across its I/O, see
+ * jobslots_take(); if none are available, the section is scanned serially
+ * rather than stalling the worker pool.
+ */
+static bool
+reloc_shards(struct objctx *ctx, size_t relndx, size_t symndx, size_t targndx,
+    const uint64_t *map, size_t nrels)
+{
+	struct relshard *sh, *shards;
+	char errmsg[sizeof(sh->errmsg)];
+	size_t failed, i, nshards, nthreads;
+	int error, phase;
+
+	if (ctx->slots == NULL || ctx->verbose || nrels < 2 * RELOC_SHARDSZ)
+		return (false);
+	nshards = 1 + jobslots_take(ctx->slots,
+	    MIN(nrels / RELOC_SHARDSZ, UINT_MAX) - 1);
+	if (nshards == 1)
+		return (false);
+
+	/* The shards share the function table, so build it beforehand. */
+	phase = stats_nest(ctx, PHASE_SYMBOLS);
+	(void)functab_get(ctx, symndx, targndx);
+	(void)stats_nest(ctx, phase);
+
+	shards = xmalloc(nshards * sizeof(*shards));
+	for (i = 0; i < nshards; i++) {
+		sh = &shards[i];
+		sh->ctx = *ctx;
+		sh->ctx.shard = sh;
+		sh->ctx.dostats = sh->ctx.doperf = false;
+		LIST_INIT(&sh->ctx.arena);
+		sh->ctx.probes = NULL;
+		sh->ctx.nprobes = sh->ctx.probecap = 0;
+		memset(&sh->ctx.probenames, 0, sizeof(sh->ctx.probenames));
+		sh->ctx.insts = NULL;
+		sh->ctx.ninsts = sh->ctx.instcap = 0;
+		sh->relndx = relndx;
+		sh->symndx = symndx;
+		sh->targndx = targndx;
+		sh->map = map;
+		sh->first = nrels * i / nshards;
+		sh->last = nrels * (i + 1) / nshards;
+		sh->dirtylo[0] = sh->dirtyhi[0] = 0;
+		sh->dirtylo[1] = sh->dirtyhi[1] = 0;
+		sh->failed = false;
+	}
+	for (nthreads = 1; nthreads < nshards; nthreads++) {
+		error = pthread_create(&shards[nthreads].tid, NULL,
+		    reloc_shard_run, &shards[nthreads]);
+		if (error != 0) {
+			/* Scan the remaining shards on this thread instead. */
+			jobslots_put(ctx->slots, nshards - nthreads);
+			break;
+		}
+	}
+	(void)reloc_shard_run(&shards[0]);
+	for (i = nthreads; i < nshards; i++)
+		(void)reloc_shard_run(&shards[i]);
+	for (i = 1; i < nthreads; i++)
+		(void)pthread_join(shards[i].tid, NULL);
+	jobslots_put(ctx->slots, nthreads - 1);
+
+	/* Report the error that a serial scan would have hit first. */
+	for (failed = 0; failed < nshards && !shards[failed].failed; failed++)
+		;
+	if (failed == nshards)
+		reloc_shards_merge(ctx, shards, nshards);
+	else
+		strlcpy(errmsg, shards[failed].errmsg, sizeof(errmsg));
+	for (i = 0; i < nshards; i++)
+		arena_free(&shards[i].ctx.arena);
+	free(shards);
+	if (failed < nshards)
+		objerrx(ctx, "%s", errmsg);
+	return (true);
+}
+
+/*
+ * Merge the results of the shards of a relocation section into the object's
+ * context. Probes are interned in the order in which each shard first saw
+ * them, so that they are numbered as by a serial scan.
+ */
+static void
+reloc_shards_merge(struct objctx *ctx, struct relshard *shards,
+    size_t nshards)
+{
+	struct objctx *sctx;
+	struct probe_instance *inst;
+	size_t cap, i, j, *probemap;
+
+	for (i = 0; i < nshards; i++) {
+		sctx = &shards[i].ctx;
+		probemap = arena_alloc(&sctx->arena,
+		    sctx->nprobes * sizeof(*probemap));
+		for (j = 0; j < sctx->nprobes; j++)
+			probemap[j] = probe_intern(ctx, sctx->probes[j].symname);
+
+		for (cap = ctx->instcap == 0 ? 64 : ctx->instcap;
+		    cap < ctx->ninsts + sctx->ninsts; cap *= 2)
+			;
+		if (cap != ctx->instcap) {
+			ctx->insts = arena_realloc(&ctx->arena, ctx->insts,
+			    ctx->instcap * sizeof(*ctx->insts),
+			    cap * sizeof(*ctx->insts));
+			ctx->instcap = cap;
+		}
+		for (j = 0; j < sctx->ninsts; j++) {
+			inst = &ctx->insts[ctx->ninsts++];
+			*inst = sctx->insts[j];
+			inst->probe = probemap[inst->probe];
+		}
+
+		for (j = 0; j < 2; j++)
+			if (shards[i].dirtyhi[j] != shards[i].dirtylo[j])
+				mark_dirty(ctx, j == 0 ? shards[i].relndx :
+				    shards[i].targndx, shards[i].dirtylo[j],
+				    shards[i].dirtyhi[j] - shards[i].dirtylo[j]);
+	}
+}
+
+/*
+ * Update the offset and info fields of relocation i in the specified section.
+ * The addend is left unchanged.
+ */
+static void
+reloc_update(struct objctx *ctx, size_t relndx, size_t i,
+    const GElf_Rela *rela)
+{
+	Elf32_Rel rel32;
+	Elf64_Rel rel64;
+	uint8_t *p;
+	size_t relsz;
+
+	/* The offset and info fields are shared by Elf_Rel and Elf_Rela. */
+	if (ctx->class == ELFCLASS32) {
+		relsz = ctx->scns[relndx].shdr.sh_type == SHT_RELA ?
+		    sizeof(Elf32_Rela) : sizeof(Elf32_Rel);
+		rel32.r_offset = rela->r_offset;
+		rel32.r_info = ELF32_R_INFO(GELF_R_SYM(rela->r_info),
+		    GELF_R_TYPE(rela->r_info));
+		p = ctx->scns[relndx].data + i * relsz;
+		memcpy(p, &rel32, sizeof(rel32));
+	} else {
+		relsz = ctx->scns[relndx].shdr.sh_type == SHT_RELA ?
+		    sizeof(Elf64_Rela) : sizeof(Elf64_Rel);
+		rel64.r_offset = rela->r_offset;
+		rel64.r_info = rela->r_info;
+		p = ctx->scns[relndx].data + i * relsz;
+		memcpy(p, &rel64, sizeof(rel64));
+	}
+	mark_dirty(ctx, relndx, i * relsz, relsz);
+}
+
+/*
+ * Process the specified objects using a pool of up to nworkers worker threads.
+ * The pool starts with a single worker, which uses the calling thread's job
+ * slot, and grows and shrinks as slots become available, see worker().
+ * Diagnostics from each object are written to stderr as soon as that object
+ * and all of its predecessors on the command line have been processed.
+ */
+static void
+run_workers(struct objctx *objs, size_t nobjs, u_int nworkers,
+    void (*done)(struct objctx *, void *), void *arg)
+{
+	struct workq wq;
+	struct stat sb;
+	size_t i;
+	int error;
+
+	for (i = 0; i < nobjs; i++) {
+		objs[i].size = stat(objs[i].path, &sb) == 0 ? sb.st_size : 0;
+		objs[i].diag = open_memstream(&objs[i].diagbuf,
+		    &objs[i].diaglen);
+		if (objs[i].diag == NULL)
+			err(1, "open_memstream");
+	}
+
+	wq.objs = objs;
+	wq.nobjs = nobjs;
+	wq.next = wq.advised = 0;
+	wq.order = xmalloc(nobjs * sizeof(*wq.order));
+	for (i = 0; i < nobjs; i++)
+		wq.order[i] = &objs[i];
+	qsort(wq.order, nobjs, sizeof(*wq.order), objsize_cmp);
+	if ((error = pthread_mutex_init(&wq.lock, NULL)) != 0)
+		errc(1, error, "pthread_mutex_init");
+	if ((error = pthread_cond_init(&wq.cv, NULL)) != 0)
+		errc(1, error, "pthread_cond_init");
+
+	/* Workers are only started as objects are claimed. */
+	wq.tids = xmalloc(nobjs * sizeof(*wq.tids));
+	wq.ntids = 0;
+	wq.running = wq.taken = 0;
+	wq.maxworkers = MIN(nworkers, nobjs);
+	wq.batch = uring_batch(wq.maxworkers);
+	wq.lanes = xmalloc(wq.maxworkers * sizeof(*wq.lanes));
+	memset(wq.lanes, 0, wq.maxworkers * sizeof(*wq.lanes));
+	wq.slots = objs[0].slots;
+	pthread_mutex_lock(&wq.lock);
+	worker_start(&wq);
+	pthread_mutex_unlock(&wq.lock);
+
+	for (i = 0; i < nobjs; i++) {
+		pthread_mutex_lock(&wq.lock);
+		while (!objs[i].done)
+			pthread_cond_wait(&wq.cv, &wq.lock);
+		pthread_mutex_unlock(&wq.lock);
+
+		(void)fclose(objs[i].diag);
+		objs[i].diag = NULL;
+		done(&objs[i], arg);
+		free(objs[i].diagbuf);
+	}
+
+	/* All objects have been claimed, so no more workers are started. */
+	for (i = 0; i < wq.ntids; i++)
+		(void)pthread_join(wq.tids[i], NULL);
+	free(wq.tids);
+	free(wq.lanes);
+	free(wq.order);
+	(void)pthread_cond_destroy(&wq.cv);
+	(void)pthread_mutex_destroy(&wq.lock);
+}
+
+/*
+ * Build the section directory in a single pass over the section headers. For
+ * each section with relocations, the first relocation section that applies to
+ * it is recorded, and the relocation sections to scan and the symbol table are
+ * noted, so that later lookups need not walk the section table, which is large
+ * for objects built with -ffunction-sections.
+ */
+static void
+scndir_init(struct objctx *ctx)
+{
+	GElf_Shdr *shdr;
+	size_t i;
+
+	ctx->relscns = arena_alloc(&ctx->arena,
+	    ctx->nscns * sizeof(*ctx->relscns));
+	ctx->nrelscns = 0;
+	ctx->symtabndx = SHN_UNDEF;
+
+	for (i = 1; i < ctx->nscns; i++) {
+		shdr = &ctx->scns[i].shdr;
+		switch (shdr->sh_type) {
+		case SHT_REL:
+		case SHT_RELA:
+			ctx->relscns[ctx->nrelscns++] = i;
+			if (shdr->sh_info != SHN_UNDEF &&
+			    shdr->sh_info < ctx->nscns &&
+			    ctx->scns[shdr->sh_info].relndx == SHN_UNDEF)
+				ctx->scns[shdr->sh_info].relndx = i;
+			break;
+		case SHT_SYMTAB:
+			if (ctx->symtabndx == SHN_UNDEF)
+				ctx->symtabndx = i;
+			break;
+		}
+	}
+}
+
+/*
+ * Append data to a section builder, returning the offset of the data within the
+ * section. If data is NULL, sz zero bytes are appended.
+ */
+static size_t
+secbuf_append(struct secbuf *sb, const void *data, size_t sz)
+{
+	size_t ocap, off;
+
+	if (sb->len + sz > sb->cap) {
+		ocap = sb->cap;
+		do {
+			sb->cap = sb->cap == 0 ? 64 : 2 * sb->cap;
+		} while (sb->len + sz > sb->cap);
+		sb->buf = arena_realloc(sb->arena, sb->buf, ocap, sb->cap);
+	}
+	if (data != NULL)
+		memcpy(sb->buf + sb->len, data, sz);
+	else
+		memset(sb->buf + sb->len, 0, sz);
+	off = sb->base + sb->len;
+	sb->len += sz;
+	return (off);
+}
+
+/*
+ * Account for the accumulated data in the section header. The data itself is
+ * written out by the backend; the buffer is released with the object's arena.
+ */
+static void
+secbuf_finish(struct objctx *ctx, struct secbuf *sb)
+{
+
+	if (sb->len == 0)
+		return;
+	ctx->scns[sb->ndx].shdr.sh_size += sb->len;
+}
+
+/*
+ * Prepare to append data to the specified section, reserving space for
+ * reserve bytes.
+ */
+static void
+secbuf_init(struct objctx *ctx, struct secbuf *sb, size_t ndx, size_t reserve)
+{
+
+	sb->arena = &ctx->arena;
+	sb->ndx = ndx;
+	sb->base = ctx->scns[ndx].shdr.sh_size;
+	sb->len = 0;
+	sb->cap = reserve;
+	sb->buf = arena_alloc(&ctx->arena, reserve);
+	ctx->scns[ndx].sb = sb;
+}
+
+/*
+ * Return the libelf data type of a section's contents, used to convert them to
+ * the file representation.
+ */
+static Elf_Type
+section_data_type(const struct objscn *scn)
+{
+
+	if (scn->edata != NULL)
+		return (scn->edata->d_type);
+	switch (scn->shdr.sh_type) {
+	case SHT_REL:
+		return (ELF_T_REL);
+	case SHT_RELA:
+		return (ELF_T_RELA);
+	case SHT_SYMTAB:
+		return (ELF_T_SYM);
+	default:
+		return (ELF_T_BYTE);
+	}
+}
+
+/*
+ * Look up an ELF section by name. Returns SHN_UNDEF if there is none. This is
+ * done once per object, so a scan of the cached section names is cheaper than
+ * building an index.
+ */
+static size_t
+section_by_name(struct objctx *ctx, const char *name)
+{
+	size_t i;
+
+	for (i = 1; i < ctx->nscns; i++)
+		if (strcmp(get_section_name(ctx, i), name) == 0)
+			return (i);
+	return (SHN_UNDEF);
+}
+
+/*
+ * Server mode. Clients connect to a UNIX domain socket, send the paths of the
+ * objects to process, each terminated by a NUL character, and then shut down
+ * their side of the connection. For each object, in the order in which they
+ * were sent, the server replies with a line containing "ok" or "error" and the
+ * length of the object's diagnostics, followed by the diagnostics themselves.
+ * An error in one object does not affect the others or the server. Each client
+ * is served by its own thread, so that one which is slow to send its request
+ * or read the replies does not hold up the others, with up to njobs workers.
+ * Workers beyond the client's thread share the job slots of the server. Only
+ * the result cache is kept across requests; workers are started for each.
+ */
+static void
+serve(const char *sockpath, const struct objctx *proto, u_int njobs,
+    bool perobj)
+{
+	struct serve_conn *conn;
+	struct sockaddr_un sun;
+	struct stat sb;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int c, error, s;
+
+	sockaddr_init(&sun, sockpath);
+	if ((s = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	/* Remove a socket left behind by a previous server. */
+	if (lstat(sockpath, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		(void)unlink(sockpath);
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+		err(1, "failed to bind to %s", sockpath);
+	if (listen(s, 16) != 0)
+		err(1, "listen");
+
+	/* Clients that go away must not take the server with them. */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	if ((error = pthread_attr_init(&attr)) != 0)
+		errc(1, error, "pthread_attr_init");
+	(void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		if ((c = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		conn = xmalloc(sizeof(*conn));
+		conn->s = c;
+		conn->proto = proto;
+		conn->njobs = njobs;
+		conn->perobj = perobj;
+		error = pthread_create(&tid, &attr, serve_client, conn);
+		if (error != 0) {
+			/* Serve the client here rather than dropping it. */
+			warnc(error, "pthread_create");
+			(void)serve_client(conn);
+		}
+	}
+}
+
+/*
+ * Handle a single client request; the connection is closed when done. The
+ * cache is trimmed after each request, as it would be at exit.
+ */
+static void *
+serve_client(void *arg)
+{
+	struct pathlist paths;
+	struct serve_conn *conn;
+	const struct objctx *proto;
+	struct objctx *objs;
+	FILE *in, *out;
+	int fd, s;
+
+	conn = arg;
+	s = conn->s;
+	proto = conn->proto;
+	in = out = NULL;
+	if ((fd = dup(s)) < 0 || (in = fdopen(fd, "r")) == NULL ||
+	    (out = fdopen(s, "w")) == NULL) {
+		warn("failed to set up client connection");
+		if (in != NULL)
+			(void)fclose(in);
+		else if (fd >= 0)
+			(void)close(fd);
+		(void)close(s);
+		free(conn);
+		return (NULL);
+	}
+
+	memset(&paths, 0, sizeof(paths));
+	if (pathlist_readfp(&paths, in, '\0') == 0 && paths.count > 0) {
+		objs = xmalloc(paths.count * sizeof(*objs));
+		for (size_t i = 0; i < paths.count; i++) {
+			objs[i] = *proto;
+			objs[i].path = paths.paths[i];
+			objs[i].recover = true;
+		}
+		run_workers(objs, paths.count, conn->njobs, serve_reply, out);
+		if (proto->dostats) {
+			/* Keep concurrent requests' reports apart. */
+			flockfile(stderr);
+			stats_report(objs, paths.count, conn->perobj);
+			funlockfile(stderr);
+		}
+		free(objs);
+	}
+	pathlist_free(&paths);
+
+	(void)fclose(in);
+	(void)fclose(out);
+	if (proto->cache != NULL)
+		cache_trim(proto->cache);
+	free(conn);
+	return (NULL);
+}
+
+static void
+serve_reply(struct objctx *ctx, void *arg)
+{
+	FILE *out;
+
+	out = arg;
+	fprintf(out, "%s %zu\n", ctx->failed ? "error" : "ok", ctx->diaglen);
+	fwrite(ctx->diagbuf, 1, ctx->diaglen, out);
+}
+
+static void
+sockaddr_init(struct sockaddr_un *sun, const char *path)
+{
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_LOCAL;
+	if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >=
+	    sizeof(sun->sun_path))
+		errx(1, "socket path '%s' is too long", path);
+}
+
+static void
+stats_begin(struct objctx *ctx)
+{
+	struct objstats *st;
+
+	if (!ctx->dostats)
+		return;
+	st = &ctx->stats;
+	memset(st, 0, sizeof(*st));
+	st->phase = PHASE_OPEN;
+	st->lastwall = clock_ns(CLOCK_MONOTONIC);
+	st->spanbeg[PHASE_OPEN] = st->lastwall;
+	st->lastcpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (ctx->doperf && perf_open(ctx->perffds) == 0)
+		st->hwcounters = perf_read(ctx->perffds, st->lastcounters);
+}
+
+/* Charge the remaining time and release the counters. */
+static void
+stats_end(struct objctx *ctx)
+{
+
+	if (!ctx->dostats)
+		return;
+	stats_phase(ctx, PHASE_OTHER);
+	ctx->stats.spanend[PHASE_OTHER] = ctx->stats.lastwall;
+	if (ctx->doperf)
+		perf_close(ctx->perffds);
+}
+
+/*
+ * Switch to a phase nested within the current one, returning the current
+ * phase so that the caller can switch back to it.
+ */
+static int
+stats_nest(struct objctx *ctx, int phase)
+{
+
+	return (stats_switch(ctx, phase, false));
+}
+
+/* Move on to the next phase of processing an object. */
+static void
+stats_phase(struct objctx *ctx, int phase)
+{
+
+	(void)stats_switch(ctx, phase, true);
+}
+
+/*
+ * Charge the time elapsed since the last phase change to the current phase and
+ * switch to a new one. Returns the previous phase. For top-level phases, the
+ * start of the new phase and the end of the previous one are recorded.
+ */
+static int
+stats_switch(struct objctx *ctx, int phase, bool toplevel)
+{
+	struct objstats *st;
+	uint64_t cpu, wall, vals[NCOUNTERS];
+	int prev;
+
+	if (!ctx->dostats)
+		return (phase);
+	st = &ctx->stats;
+	wall = clock_ns(CLOCK_MONOTONIC);
+	cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	st->wall[st->phase] += wall - st->lastwall;
+	st->cpu[st->phase] += cpu - st->lastcpu;
+	st->lastwall = wall;
+	st->lastcpu = cpu;
+	if (st->hwcounters) {
+		if (perf_read(ctx->perffds, vals)) {
+			for (int i = 0; i < NCOUNTERS; i++) {
+				st->counters[st->phase][i] +=
+				    vals[i] - st->lastcounters[i];
+				st->lastcounters[i] = vals[i];
+			}
+		} else
+			st->hwcounters = false;
+	}
+	if (toplevel) {
+		st->spanend[st->phase] = wall;
+		if (st->spanbeg[phase] == 0)
+			st->spanbeg[phase] = wall;
+	}
+	prev = st->phase;
+	st->phase = phase;
+	return (prev);
+}
+
+/*
+ * Print statistics for a set of processed objects: totals, and optionally a
+ * line per object. With multiple workers, the per-phase times are summed over
+ * all of them.
+ */
+static void
+stats_report(const struct objctx *objs, size_t nobjs, bool perobj)
+{
+	static const char *secbufs[NSECBUFS] = {
+		".shstrtab", ".strtab", ".symtab", ".data", ".data relocations",
+		"set_sdt_instances_set", "set_sdt_instances_set relocations"
+	};
+	struct objstats total;
+	const struct objstats *st;
+	struct rusage ru;
+	uintmax_t nresults[NRESULTS];
+	size_t i, ncounted;
+	int j, k;
+
+	memset(&total, 0, sizeof(total));
+	memset(nresults, 0, sizeof(nresults));
+	ncounted = 0;
+	for (i = 0; i < nobjs; i++) {
+		st = &objs[i].stats;
+		for (j = 0; j < NPHASES; j++) {
+			total.wall[j] += st->wall[j];
+			total.cpu[j] += st->cpu[j];
+		}
+		if (st->hwcounters) {
+			for (j = 0; j < NPHASES; j++)
+				for (k = 0; k < NCOUNTERS; k++)
+					total.counters[j][k] +=
+					    st->counters[j][k];
+			ncounted++;
+		}
+		for (j = 0; j < NSECBUFS; j++)
+			total.appended[j] += st->appended[j];
+		total.relocs += st->relocs;
+		total.probes += st->probes;
+		nresults[st->result]++;
+
+		if (!perobj)
+			continue;
+		fprintf(stderr, "stats: %s: %s, %ju relocations, %ju probes;",
+		    objs[i].path, result_names[st->result], (uintmax_t)st->relocs,
+		    (uintmax_t)st->probes);
+		for (j = 0; j < NPHASES; j++)
+			fprintf(stderr, " %s %.3f/%.3f", phase_names[j],
+			    st->wall[j] / 1e6, st->cpu[j] / 1e6);
+		fprintf(stderr, " ms\n");
+	}
+
+	fprintf(stderr, "stats: %zu objects:", nobjs);
+	for (j = 0; j < NRESULTS; j++)
+		fprintf(stderr, "%s %ju %s", j == 0 ? "" : ",", nresults[j],
+		    result_names[j]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "stats: %ju relocations examined, %ju probes patched\n",
+	    (uintmax_t)total.relocs, (uintmax_t)total.probes);
+	fprintf(stderr, "stats: %-10s %12s %12s\n", "phase", "wall (ms)",
+	    "cpu (ms)");
+	for (j = 0; j < NPHASES; j++)
+		fprintf(stderr, "stats: %-10s %12.3f %12.3f\n", phase_names[j],
+		    total.wall[j] / 1e6, total.cpu[j] / 1e6);
+	if (ncounted > 0) {
+		fprintf(stderr, "stats: hardware counters for %zu objects:\n",
+		    ncounted);
+		fprintf(stderr, "stats: %-10s %14s %14s %6s %14s %14s\n",
+		    "phase", "cycles", "instructions", "IPC", "cache misses",
+		    "branch misses");
+		for (j = 0; j < NPHASES; j++)
+			fprintf(stderr,
+			    "stats: %-10s %14ju %14ju %6.2f %14ju %14ju\n",
+			    phase_names[j],
+			    (uintmax_t)total.counters[j][COUNTER_CYCLES],
+			    (uintmax_t)total.counters[j][COUNTER_INSNS],
+			    total.counters[j][COUNTER_CYCLES] == 0 ? 0.0 :
+			    (double)total.counters[j][COUNTER_INSNS] /
+			    total.counters[j][COUNTER_CYCLES],
+			    (uintmax_t)total.counters[j][COUNTER_CMISS],
+			    (uintmax_t)total.counters[j][COUNTER_BMISS]);
+	}
+	for (j = 0; j < NSECBUFS; j++)
+		if (total.appended[j] > 0)
+			fprintf(stderr, "stats: appended %ju bytes to %s\n",
+			    (uintmax_t)total.appended[j], secbufs[j]);
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(stderr, "stats: peak RSS %ld KB\n", ru.ru_maxrss);
+}
+
+/*
+ * Look up a symbol by name using the object's symbol name index. Return 1 if a
+ * matching symbol was found, 0 otherwise. If several symbols share the name,
+ * the one with the lowest index is returned.
+ */
+static int
+symbol_by_name(struct objctx *ctx, const char *name, uint64_t *ndx)
+{
+
+	return (symname_lookup(&ctx->symnames, name, ndx));
+}
+
+/*
+ * Look up the function containing the specified offset using a function
+ * interval table. Return 1 if a matching symbol was found, 0 otherwise. If
+ * several function symbols contain the offset, the one with the lowest symbol
+ * table index is returned, as a linear scan of the symbol table would.
+ */
+static int
+symbol_by_offset(const struct functab *ftab, uint64_t offset, uint64_t *value,
+    uint64_t *ndx)
+{
+	const struct func_interval *iv;
+	size_t hi, lo, mid;
+	bool found;
+
+	/* Find the first interval starting after the offset. */
+	lo = 0;
+	hi = ftab->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ftab->ivs[mid].start <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/*
+	 * Walk back over the intervals starting at or before the offset until
+	 * none of the remaining ones can extend past it.
+	 */
+	found = false;
+	while (lo-- > 0 && ftab->ivs[lo].maxend > offset) {
+		iv = &ftab->ivs[lo];
+		if (iv->end > offset && (!found || iv->symndx < *ndx)) {
+			*value = iv->start;
+			*ndx = iv->symndx;
+			found = true;
+		}
+	}
+	return (found ? 1 : 0);
+}
+
+/*
+ * Retrieve the symbol at index ndx in the specified symbol table, with bounds
+ * checking.
+ */
+static GElf_Sym *
+symbol_by_index(struct objctx *ctx, size_t symndx, uint64_t ndx, GElf_Sym *sym)
+{
+
+	if (ndx >= symbol_count(ctx, symndx))
+		objerrx(ctx, "invalid symbol index %ju", (uintmax_t)ndx);
+
+	CLASS_DISPATCH(ctx, symbol_load, ctx->scns[symndx].data, ndx, sym);
+	return (sym);
+}
+
+/* Return the number of symbols in the specified symbol table. */
+static size_t
+symbol_count(struct objctx *ctx, size_t symndx)
+{
+
+	return (ctx->scns[symndx].datasz / (ctx->class == ELFCLASS32 ?
+	    sizeof(Elf32_Sym) : sizeof(Elf64_Sym)));
+}
+
+/*
+ * Read symbol i from the data of a symbol table of the specified class. The
+ * caller is responsible for checking that i is in range.
+ */
+static __always_inline void
+symbol_load(const uint8_t *data, size_t i, GElf_Sym *sym, int class)
+{
+	Elf32_Sym sym32;
+	Elf64_Sym sym64;
+
+	if (class == ELFCLASS32) {
+		memcpy(&sym32, data + i * sizeof(sym32), sizeof(sym32));
+		sym->st_name = sym32.st_name;
+		sym->st_info = sym32.st_info;
+		sym->st_other = sym32.st_other;
+		sym->st_shndx = sym32.st_shndx;
+		sym->st_value = sym32.st_value;
+		sym->st_size = sym32.st_size;
+	} else {
+		memcpy(&sym64, data + i * sizeof(sym64), sizeof(sym64));
+		sym->st_name = sym64.st_name;
+		sym->st_info = sym64.st_info;
+		sym->st_other = sym64.st_other;
+		sym->st_shndx = sym64.st_shndx;
+		sym->st_value = sym64.st_value;
+		sym->st_size = sym64.st_size;
+	}
+}
+
+/*
+ * Add a name to the symbol name index. An existing entry for the name takes
+ * precedence, matching the first-match semantics of a linear symbol table scan.
+ * The table is grown to keep the load factor at or below one half; the old
+ * table is left to the arena.
+ */
+static void
+symname_add(struct arena *arena, struct symname_tab *tab, const char *name,
+    uint64_t ndx)
+{
+	struct symname_ent *ent, *oents;
+	size_t i, j, osize;
+	uint32_t hash;
+
+	if (*name == '\0')
+		return;
+
+	if (2 * (tab->count + 1) > tab->size) {
+		oents = tab->ents;
+		osize = tab->size;
+		tab->size = osize == 0 ? 64 : 2 * osize;
+		tab->ents = arena_alloc(arena, tab->size * sizeof(*tab->ents));
+		memset(tab->ents, 0, tab->size * sizeof(*tab->ents));
+		for (i = 0; i < osize; i++) {
+			if (oents[i].name == NULL)
+				continue;
+			for (j = oents[i].hash & (tab->size - 1);
+			    tab->ents[j].name != NULL;
+			    j = (j + 1) & (tab->size - 1))
+				;
+			tab->ents[j] = oents[i];
+		}
+	}
+
+	hash = symname_hash(name);
+	for (i = hash & (tab->size - 1); tab->ents[i].name != NULL;
+	    i = (i + 1) & (tab->size - 1)) {
+		ent = &tab->ents[i];
+		if (ent->hash == hash && strcmp(ent->name, name) == 0)
+			return;
+	}
+
+	ent = &tab->ents[i];
+	ent->name = name;
+	ent->ndx = ndx;
+	ent->hash = hash;
+	tab->count++;
+}
+
+/* 32-bit FNV-1a. */
+static uint32_t
+symname_hash(const char *name)
+{
+	uint32_t hash;
+
+	for (hash = 2166136261u; *name != '\0'; name++) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619u;
+	}
+	return (hash);
+}
+
+/*
+ * Build the symbol name index for the specified symbol table in a single pass.
+ * Symbols appended later on must be added using symname_add().
+ */
+static void
+symname_init(struct objctx *ctx, size_t symndx)
+{
+	struct symname_tab *tab;
+	size_t nsyms;
+
+	nsyms = symbol_count(ctx, symndx);
+
+	/* Size the table up front to avoid rehashing during the scan. */
+	tab = &ctx->symnames;
+	for (tab->size = 64; tab->size < 2 * nsyms; tab->size *= 2)
+		;
+	tab->ents = arena_alloc(&ctx->arena, tab->size * sizeof(*tab->ents));
+	memset(tab->ents, 0, tab->size * sizeof(*tab->ents));
+	CLASS_DISPATCH(ctx, symname_scan, ctx, symndx, nsyms);
+}
+
+/*
+ * Look up a name in a symbol name index. Return 1 and set *ndx if it is
+ * present, 0 otherwise.
+ */
+static int
+symname_lookup(const struct symname_tab *tab, const char *name, uint64_t *ndx)
+{
+	const struct symname_ent *ent;
+	uint32_t hash;
+	size_t i;
+
+	if (tab->size == 0)
+		return (0);
+
+	hash = symname_hash(name);
+	for (i = hash & (tab->size - 1); tab->ents[i].name != NULL;
+	    i = (i + 1) & (tab->size - 1)) {
+		ent = &tab->ents[i];
+		if (ent->hash == hash && strcmp(ent->name, name) == 0) {
+			*ndx = ent->ndx;
+			return (1); /* There's my chippy. */
+		}
+	}
+	return (0);
+}
+
+static __always_inline void
+symname_scan(struct objctx *ctx, size_t symndx, size_t nsyms, int class)
+{
+	GElf_Sym sym;
+	const uint8_t *data;
+	const char *symname;
+	size_t i, strndx;
+
+	data = ctx->scns[symndx].data;
+	strndx = ctx->scns[symndx].shdr.sh_link;
+	for (i = 0; i < nsyms; i++) {
+		symbol_load(data, i, &sym, class);
+		symname = objstr(ctx, strndx, sym.st_name);
+		if (symname != NULL)
+			symname_add(&ctx->arena, &ctx->symnames, symname, i);
+	}
+}
+
+static int
+wordsize(struct objctx *ctx)
+{
+
+	return (ctx->class == ELFCLASS32 ? 4 : 8);
+}
+
+/*
+ * Worker thread loop: claim the next largest unprocessed object, or a batch of
+ * objects with --io-uring, and process it, until none remain. The pool holds
+ * the slot of the thread which started it, and "taken" slots for its other
+ * workers. While objects remain unclaimed, another worker is started whenever
+ * a slot can be taken, and between objects a worker hands one of the taken
+ * slots back and exits if it cannot take it again, so that the pool shrinks if
+ * other jobs of a parallel make use the slot. Job slots are taken and returned
+ * without holding the work queue lock.
+ */
+static void *
+worker(void *arg)
+{
+	struct workq *wq;
+	struct objctx *ctx;
+	struct uring *ring;
+	size_t batch, first, i, last, n;
+	u_int id;
+	bool grow, put, shrink;
+
+	wq = arg;
+	ring = wq->objs[0].useuring ? uring_open(URING_ENTRIES) : NULL;
+	pthread_mutex_lock(&wq->lock);
+	for (id = 0; wq->lanes[id]; id++)
+		;
+	wq->lanes[id] = true;
+
+	shrink = false;
+	while (wq->next < wq->nobjs) {
+		/*
+		 * With io_uring, objects are claimed in batches, small enough
+		 * that the remaining objects are still spread over all of the
+		 * workers.
+		 */
+		batch = wq->next;
+		n = 1;
+		if (ring != NULL)
+			n = MAX(1, MIN(wq->batch,
+			    (wq->nobjs - wq->next) / wq->maxworkers));
+		wq->next += n;
+		grow = wq->next < wq->nobjs && wq->running < wq->maxworkers &&
+		    wq->slots != NULL;
+		first = MAX(wq->advised, wq->next);
+		last = MIN(wq->next + wq->objs[0].readahead, wq->nobjs);
+		if (last > wq->advised)
+			wq->advised = last;
+		pthread_mutex_unlock(&wq->lock);
+
+		if (grow && jobslots_take(wq->slots, 1) == 1) {
+			pthread_mutex_lock(&wq->lock);
+			grow = wq->next < wq->nobjs &&
+			    wq->running < wq->maxworkers;
+			if (grow) {
+				wq->taken++;
+				worker_start(wq);
+			}
+			pthread_mutex_unlock(&wq->lock);
+			if (!grow)
+				jobslots_put(wq->slots, 1);
+		}
+
+		for (i = first; i < last; i++)
+			obj_readahead(wq->order[i]->path);
+		if (ring != NULL)
+			uring_prefilter(ring, &wq->order[batch], n);
+
+		for (i = batch; i < batch + n; i++) {
+			ctx = wq->order[i];
+			ctx->worker = id + 1;
+			ctx->ring = ring;
+			process_obj(ctx);
+			ctx->ring = NULL;
+
+			pthread_mutex_lock(&wq->lock);
+			ctx->done = true;
+			pthread_cond_broadcast(&wq->cv);
+			if (i < batch + n - 1)
+				pthread_mutex_unlock(&wq->lock);
+		}
+		if (wq->taken > 0 && wq->next < wq->nobjs) {
+			wq->taken--;
+			pthread_mutex_unlock(&wq->lock);
+			jobslots_put(wq->slots, 1);
+			shrink = jobslots_take(wq->slots, 1) == 0;
+			pthread_mutex_lock(&wq->lock);
+			if (shrink)
+				break;
+			wq->taken++;
+		}
+	}
+
+	wq->lanes[id] = false;
+	wq->running--;
+	put = !shrink && wq->taken > 0;
+	if (put)
+		wq->taken--;
+	pthread_mutex_unlock(&wq->lock);
+	if (put)
+		jobslots_put(wq->slots, 1);
+	uring_close(ring);
+	return (NULL);
+}
+
+/*
+ * Start a worker thread, which uses a job slot already taken by the caller.
+ * Called with the work queue locked.
+ */
+static void
+worker_start(struct workq *wq)
+{
+	int error;
+
+	error = pthread_create(&wq->tids[wq->ntids], NULL, worker, wq);
+	if (error != 0)
+		errc(1, error, "pthread_create");
+	wq->ntids++;
+	wq->running++;
 }
 
 static void *
@@ -890,31 +4433,935 @@ xmalloc(size_t n)
 	return (ret);
 }
 
+/*
+ * The XXH64 hash function. The input is read in host byte order; the result is
+ * only used to name entries in a result cache local to the host.
+ */
+#define	XXH_P1	0x9e3779b185ebca87ULL
+#define	XXH_P2	0xc2b2ae3d27d4eb4fULL
+#define	XXH_P3	0x165667b19e3779f9ULL
+#define	XXH_P4	0x85ebca77c2b2ae63ULL
+#define	XXH_P5	0x27d4eb2f165667c5ULL
+#define	XXH_ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t val)
+{
+
+	acc += val * XXH_P2;
+	acc = XXH_ROTL(acc, 31);
+	return (acc * XXH_P1);
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+
+	acc ^= xxh64_round(0, val);
+	return (acc * XXH_P1 + XXH_P4);
+}
+
+static uint64_t
+xxh64(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p, *end;
+	uint64_t h, v1, v2, v3, v4, w;
+	uint32_t w32;
+
+	p = buf;
+	end = p + len;
+	if (len >= 32) {
+		v1 = seed + XXH_P1 + XXH_P2;
+		v2 = seed + XXH_P2;
+		v3 = seed;
+		v4 = seed - XXH_P1;
+		do {
+			memcpy(&w, p, 8);
+			v1 = xxh64_round(v1, w);
+			memcpy(&w, p + 8, 8);
+			v2 = xxh64_round(v2, w);
+			memcpy(&w, p + 16, 8);
+			v3 = xxh64_round(v3, w);
+			memcpy(&w, p + 24, 8);
+			v4 = xxh64_round(v4, w);
+			p += 32;
+		} while (end - p >= 32);
+		h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) +
+		    XXH_ROTL(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else
+		h = seed + XXH_P5;
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		memcpy(&w, p, 8);
+		h ^= xxh64_round(0, w);
+		h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (end - p >= 4) {
+		memcpy(&w32, p, 4);
+		h ^= (uint64_t)w32 * XXH_P1;
+		h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_P5;
+		h = XXH_ROTL(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return (h);
+}
+
+static void
+trace_string(FILE *fp, const char *str)
+{
+
+	fputc('"', fp);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Write a trace in the Chrome trace event format, viewable with Perfetto or
+ * chrome://tracing. Each object gets a span covering its processing, with a
+ * span for each phase nested inside, on the track of the worker thread that
+ * processed it. Timestamps are relative to base.
+ */
+static void
+trace_write(const char *path, uint64_t base, const struct objctx *objs,
+    size_t nobjs, u_int nthreads)
+{
+	const struct objstats *st;
+	FILE *fp;
+	uint64_t beg, end;
+	size_t i;
+	u_int t;
+	int j;
+	pid_t pid;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "failed to open %s", path);
+	pid = getpid();
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (t = 0; t <= nthreads; t++)
+		fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\","
+		    "\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}},\n",
+		    (int)pid, t, t == 0 ? "main" : "worker", t);
+	for (i = 0; i < nobjs; i++) {
+		st = &objs[i].stats;
+		beg = st->spanbeg[PHASE_OPEN];
+		end = st->spanend[PHASE_OTHER];
+		if (beg == 0 || end < beg)
+			continue;
+		fprintf(fp, "{\"name\":");
+		trace_string(fp, objs[i].path);
+		fprintf(fp, ",\"cat\":\"object\",\"ph\":\"X\",\"ts\":%.3f,"
+		    "\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{"
+		    "\"result\":\"%s\",\"size\":%jd,\"relocations\":%ju,"
+		    "\"probes\":%ju}},\n",
+		    (beg - base) / 1e3, (end - beg) / 1e3, (int)pid,
+		    objs[i].worker, result_names[st->result],
+		    (intmax_t)st->size, (uintmax_t)st->relocs,
+		    (uintmax_t)st->probes);
+		for (j = 0; j < NPHASES; j++) {
+			beg = st->spanbeg[j];
+			end = st->spanend[j];
+			if (beg == 0 || end <= beg)
+				continue;
+			fprintf(fp, "{\"name\":\"%s\",\"cat\":\"phase\","
+			    "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+			    "\"tid\":%u,\"args\":{\"cpu_ms\":%.3f}},\n",
+			    phase_names[j], (beg - base) / 1e3,
+			    (end - beg) / 1e3, (int)pid, objs[i].worker,
+			    st->cpu[j] / 1e6);
+		}
+	}
+	/* The last element has no trailing comma. */
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"args\":{\"name\":\"%s\"}}\n]}\n", (int)pid, getprogname());
+	if (ferror(fp) || fclose(fp) != 0)
+		err(1, "failed to write %s", path);
+}
+
+/*
+ * Return the number of objects to prefilter at a time with io_uring, given the
+ * number of threads doing so. The objects of a batch are kept open until they
+ * are processed, so the batches of all threads together are limited to a
+ * quarter of the descriptor limit.
+ */
+static size_t
+uring_batch(u_int nthreads)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+		return (URING_BATCH);
+	return (MAX(1, MIN(URING_BATCH, rl.rlim_cur / 4 / nthreads)));
+}
+
+/* Release an io_uring instance, if any. */
+static void
+uring_close(struct uring *ring)
+{
+
+#ifdef __linux__
+	if (ring == NULL)
+		return;
+	if (ring->sqes != MAP_FAILED)
+		(void)munmap(ring->sqes, ring->sqesz);
+	if (ring->cqmap != MAP_FAILED && ring->cqmap != ring->sqmap)
+		(void)munmap(ring->cqmap, ring->cqmapsz);
+	if (ring->sqmap != MAP_FAILED)
+		(void)munmap(ring->sqmap, ring->sqmapsz);
+	(void)close(ring->fd);
+	free(ring);
+#endif
+}
+
+/*
+ * Drop the requests which have not been submitted yet, after an error in the
+ * object which queued them. Submitted requests have always completed, unless
+ * the ring has failed, see uring_wait().
+ */
+static void
+uring_discard(struct uring *ring)
+{
+
+#ifdef __linux__
+	ring->pending -= ring->tail - ring->subtail;
+	ring->tail = ring->subtail;
+#endif
+}
+
+/*
+ * Wait for the object's queued writes, and complete any short writes, and
+ * writes which could not be submitted, with pwrite(2).
+ */
+static void
+uring_flush(struct objctx *ctx)
+{
+	struct uring_write *w;
+	size_t i, n;
+	int error;
+
+	if (ctx->nwrites == 0)
+		return;
+	error = uring_wait(ctx->ring);
+	n = ctx->nwrites;
+	ctx->nwrites = 0;
+	if (error != 0) {
+		errno = error;
+		objerr(ctx, "failed to write %s", ctx->path);
+	}
+	for (i = 0; i < n; i++) {
+		w = &ctx->writes[i];
+		if (w->res == -ECANCELED)
+			w->res = 0;
+		if (w->res < 0) {
+			errno = -w->res;
+			objerr(ctx, "failed to write %s", ctx->path);
+		}
+		if ((size_t)w->res < w->len)
+			pwrite_all(ctx, (const char *)w->buf + w->res,
+			    w->len - w->res, w->off + w->res);
+	}
+}
+
+#ifdef __linux__
+/*
+ * Return a cleared submission queue entry, whose result is to be stored in
+ * *res, or -ECANCELED if the request is dropped. Callers wait for their
+ * requests before queueing more than the ring has room for: a batch of
+ * objects queues at most two requests for each.
+ */
+static struct io_uring_sqe *
+uring_get(struct uring *ring, int *res)
+{
+	struct io_uring_sqe *sqe;
+	u_int ndx;
+
+	*res = -ECANCELED;
+	ndx = ring->tail++ & *ring->sqmask;
+	ring->sqarray[ndx] = ndx;
+	ring->pending++;
+	sqe = &ring->sqes[ndx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)res;
+	return (sqe);
+}
+#endif
+
+/*
+ * Set up an io_uring instance with room for the given number of requests.
+ * Returns NULL if io_uring is unavailable, for example because it is disabled
+ * or the kernel predates any of the operations used here, in which case the
+ * caller uses regular system calls instead.
+ */
+static struct uring *
+uring_open(u_int entries)
+{
+#ifdef __linux__
+	static const uint8_t ops[] = {
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+		IORING_OP_WRITE,
+	};
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	struct uring *ring;
+	size_t i, probesz;
+	uint8_t *sq, *cq;
+	int fd;
+
+	memset(&params, 0, sizeof(params));
+	if ((fd = syscall(SYS_io_uring_setup, entries, &params)) < 0)
+		return (NULL);
+
+	probesz = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+	probe = xmalloc(probesz);
+	memset(probe, 0, probesz);
+	if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+	    256) != 0) {
+		free(probe);
+		(void)close(fd);
+		return (NULL);
+	}
+	for (i = 0; i < nitems(ops); i++) {
+		if (ops[i] > probe->last_op ||
+		    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) {
+			free(probe);
+			(void)close(fd);
+			return (NULL);
+		}
+	}
+	free(probe);
+
+	ring = xmalloc(sizeof(*ring));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	ring->sqmapsz = params.sq_off.array +
+	    params.sq_entries * sizeof(u_int);
+	ring->cqmapsz = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesz = params.sq_entries * sizeof(struct io_uring_sqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		ring->sqmapsz = ring->cqmapsz =
+		    MAX(ring->sqmapsz, ring->cqmapsz);
+	ring->sqmap = mmap(NULL, ring->sqmapsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		ring->cqmap = ring->sqmap;
+	else
+		ring->cqmap = mmap(NULL, ring->cqmapsz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqesz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqmap == MAP_FAILED || ring->cqmap == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		uring_close(ring);
+		return (NULL);
+	}
+
+	sq = ring->sqmap;
+	cq = ring->cqmap;
+	ring->sqtail = (u_int *)(sq + params.sq_off.tail);
+	ring->sqmask = (u_int *)(sq + params.sq_off.ring_mask);
+	ring->sqarray = (u_int *)(sq + params.sq_off.array);
+	ring->cqhead = (u_int *)(cq + params.cq_off.head);
+	ring->cqtail = (u_int *)(cq + params.cq_off.tail);
+	ring->cqmask = (u_int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring->tail = ring->subtail = *ring->sqtail;
+	return (ring);
+#else
+	return (NULL);
+#endif
+}
+
+/*
+ * Open and prefilter a batch of objects using io_uring, so that the system
+ * calls made by probe_prefilter() for each object are instead made once per
+ * batch: the objects are opened, then stat'ed and their ELF headers read, then
+ * their section header tables read, and finally their symbol string tables
+ * read and searched. Objects opened here are processed by process_obj() with
+ * the descriptor and status obtained here, and the result of the prefilter if
+ * it could be determined; objects for which any step fails are left to the
+ * regular path, which reports the error, if any.
+ */
+static void
+uring_prefilter(struct uring *ring, struct objctx **objs, size_t n)
+{
+#ifdef __linux__
+	struct uring_pfobj *pf, *pfs;
+	struct io_uring_sqe *sqe;
+	struct objctx *ctx;
+	uint64_t shoff, stroff, strsz;
+	size_t i, j;
+	bool found, symtab;
+
+	if (ring->error != 0)
+		return;
+	pfs = xmalloc(n * sizeof(*pfs));
+	memset(pfs, 0, n * sizeof(*pfs));
+	for (i = 0; i < n; i++) {
+		pf = &pfs[i];
+		pf->ctx = objs[i];
+		pf->ctx->prefiltered = false;
+		sqe = uring_get(ring, &pf->res);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)pf->ctx->path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	if (uring_wait(ring) != 0) {
+		/* Opens still in flight do not use the batch's memory. */
+		for (i = 0; i < n; i++)
+			if (pfs[i].res >= 0)
+				(void)close(pfs[i].res);
+		free(pfs);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		pf = &pfs[i];
+		if (pf->res < 0) {
+			pf->ctx = NULL;
+			continue;
+		}
+		pf->ctx->fd = pf->res;
+		sqe = uring_get(ring, &pf->statres);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = pf->ctx->fd;
+		sqe->addr = (uintptr_t)"";
+		sqe->len = STATX_BASIC_STATS;
+		sqe->statx_flags = AT_EMPTY_PATH;
+		sqe->off = (uintptr_t)&pf->stx;
+		sqe = uring_get(ring, &pf->res);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = pf->ctx->fd;
+		sqe->addr = (uintptr_t)pf->ehdr;
+		sqe->len = sizeof(pf->ehdr);
+		sqe->off = 0;
+	}
+	if (uring_wait(ring) != 0)
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		pf = &pfs[i];
+		if ((ctx = pf->ctx) == NULL)
+			continue;
+		if (pf->statres < 0) {
+			(void)close(ctx->fd);
+			ctx->fd = -1;
+			pf->ctx = NULL;
+			continue;
+		}
+		/* Special file device numbers are not needed. */
+		memset(&ctx->sb, 0, sizeof(ctx->sb));
+		ctx->sb.st_dev = makedev(pf->stx.stx_dev_major,
+		    pf->stx.stx_dev_minor);
+		ctx->sb.st_ino = pf->stx.stx_ino;
+		ctx->sb.st_mode = pf->stx.stx_mode;
+		ctx->sb.st_nlink = pf->stx.stx_nlink;
+		ctx->sb.st_uid = pf->stx.stx_uid;
+		ctx->sb.st_gid = pf->stx.stx_gid;
+		ctx->sb.st_size = pf->stx.stx_size;
+		ctx->sb.st_blksize = pf->stx.stx_blksize;
+		ctx->sb.st_blocks = pf->stx.stx_blocks;
+		ctx->sb.st_atim.tv_sec = pf->stx.stx_atime.tv_sec;
+		ctx->sb.st_atim.tv_nsec = pf->stx.stx_atime.tv_nsec;
+		ctx->sb.st_mtim.tv_sec = pf->stx.stx_mtime.tv_sec;
+		ctx->sb.st_mtim.tv_nsec = pf->stx.stx_mtime.tv_nsec;
+		ctx->sb.st_ctim.tv_sec = pf->stx.stx_ctime.tv_sec;
+		ctx->sb.st_ctim.tv_nsec = pf->stx.stx_ctime.tv_nsec;
+
+		if (!prefilter_ehdr(pf->ehdr, pf->res, &shoff, &pf->shnum,
+		    &pf->shentsz)) {
+			ctx->prefiltered = ctx->maybeprobes = true;
+			pf->ctx = NULL;
+			continue;
+		}
+		if (pf->shnum * pf->shentsz > INT_MAX) {
+			pf->ctx = NULL;
+			continue;
+		}
+		pf->shdrs = xmalloc(pf->shnum * pf->shentsz);
+		sqe = uring_get(ring, &pf->res);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = ctx->fd;
+		sqe->addr = (uintptr_t)pf->shdrs;
+		sqe->len = pf->shnum * pf->shentsz;
+		sqe->off = shoff;
+	}
+	if (uring_wait(ring) != 0)
+		goto fail;
+
+	/*
+	 * Objects with more than one symbol table, or very large string
+	 * tables, are left to probe_prefilter().
+	 */
+	for (i = 0; i < n; i++) {
+		pf = &pfs[i];
+		if ((ctx = pf->ctx) == NULL)
+			continue;
+		if (pf->res != (int)(pf->shnum * pf->shentsz)) {
+			ctx->prefiltered = ctx->maybeprobes = true;
+			pf->ctx = NULL;
+			continue;
+		}
+		found = symtab = false;
+		for (j = 0; j < pf->shnum && !found; j++) {
+			switch (prefilter_strtab(pf->shdrs, pf->shnum,
+			    pf->shentsz, j, &stroff, &strsz)) {
+			case 0:
+				continue;
+			case -1:
+				found = true;
+				continue;
+			}
+			if (symtab || strsz > INT_MAX)
+				break;
+			symtab = true;
+			pf->strsz = strsz;
+		}
+		if (j < pf->shnum && !found) {
+			pf->ctx = NULL;
+			continue;
+		}
+		if (found || pf->strsz == 0 ||
+		    (pf->strtab = malloc(pf->strsz)) == NULL) {
+			ctx->prefiltered = true;
+			ctx->maybeprobes = found || pf->strsz != 0;
+			pf->ctx = NULL;
+			continue;
+		}
+		sqe = uring_get(ring, &pf->res);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = ctx->fd;
+		sqe->addr = (uintptr_t)pf->strtab;
+		sqe->len = pf->strsz;
+		sqe->off = stroff;
+	}
+	if (uring_wait(ring) != 0)
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		pf = &pfs[i];
+		if ((ctx = pf->ctx) != NULL) {
+			ctx->prefiltered = true;
+			ctx->maybeprobes = pf->res != (int)pf->strsz ||
+			    prefix_search(pf->strtab, pf->strsz);
+		}
+		free(pf->strtab);
+		free(pf->shdrs);
+	}
+	free(pfs);
+	return;
+
+fail:
+	/*
+	 * Reads still in flight may write to the batch's buffers, so they are
+	 * not freed, and the objects not yet finished are left to the regular
+	 * path.
+	 */
+	for (i = 0; i < n; i++) {
+		if ((ctx = pfs[i].ctx) != NULL && ctx->fd >= 0) {
+			(void)close(ctx->fd);
+			ctx->fd = -1;
+		}
+	}
+#endif
+}
+
+/*
+ * Write out a buffer at the specified file offset. If the object has an
+ * io_uring instance, the write is only queued, and completes once
+ * uring_flush() is called, so the buffer must remain valid until then.
+ */
+static void
+uring_pwrite(struct objctx *ctx, const void *buf, size_t len, off_t off)
+{
+#ifdef __linux__
+	struct io_uring_sqe *sqe;
+	struct uring_write *w;
+
+	if (ctx->ring == NULL || ctx->ring->error != 0 || len > INT_MAX) {
+		pwrite_all(ctx, buf, len, off);
+		return;
+	}
+	if (ctx->writes == NULL)
+		ctx->writes = arena_alloc(&ctx->arena,
+		    URING_ENTRIES * sizeof(*ctx->writes));
+	else if (ctx->nwrites == URING_ENTRIES)
+		uring_flush(ctx);
+	w = &ctx->writes[ctx->nwrites++];
+	w->buf = buf;
+	w->len = len;
+	w->off = off;
+	sqe = uring_get(ctx->ring, &w->res);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = ctx->outfd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+#else
+	pwrite_all(ctx, buf, len, off);
+#endif
+}
+
+/*
+ * Submit the queued requests, and wait for all of them to complete. Requests
+ * which cannot be submitted are dropped. Returns an error number if waiting
+ * fails, in which case submitted requests may still be in flight, and the ring
+ * is not used again.
+ */
+static int
+uring_wait(struct uring *ring)
+{
+#ifdef __linux__
+	struct io_uring_cqe *cqe;
+	u_int head, tail;
+	int n;
+
+	if (ring->error != 0)
+		return (ring->error);
+	__atomic_store_n(ring->sqtail, ring->tail, __ATOMIC_RELEASE);
+	for (;;) {
+		head = *ring->cqhead;
+		tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cqmask];
+			*(int *)(uintptr_t)cqe->user_data = cqe->res;
+			ring->pending--;
+		}
+		__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+		if (ring->pending == 0)
+			break;
+
+		n = syscall(SYS_io_uring_enter, ring->fd,
+		    ring->tail - ring->subtail, 1, IORING_ENTER_GETEVENTS,
+		    NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (ring->tail == ring->subtail) {
+				ring->error = errno;
+				return (ring->error);
+			}
+			/*
+			 * Nothing was submitted. The kernel only reads the
+			 * submission queue when entered, so the requests can
+			 * still be taken back; those already submitted are
+			 * waited for.
+			 */
+			uring_discard(ring);
+			__atomic_store_n(ring->sqtail, ring->tail,
+			    __ATOMIC_RELEASE);
+			continue;
+		}
+		ring->subtail += n;
+	}
+#endif
+	return (0);
+}
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "%s: [-v] <obj> [<obj> ...]\n", getprogname());
+	fprintf(stderr,
+	    "%s: [-0LSpv] [-C cachedir] [-M cachesize] [-T listfile] [-j jobs]\n"
+	    "\t[--io-uring] [--nops type] [--perf-counters]\n"
+	    "\t[--readahead count] [--stats[=objects]] [--trace file]\n"
+	    "\t[<obj> | @listfile ...]\n",
+	    getprogname());
+	fprintf(stderr,
+	    "%s: --serve socket [-LSpv] [-C cachedir] [-M cachesize] [-j jobs]\n"
+	    "\t[--io-uring] [--nops type] [--perf-counters]\n"
+	    "\t[--readahead count] [--stats[=objects]]\n", getprogname());
+	fprintf(stderr,
+	    "%s: --client socket [-0] [-T listfile] [<obj> | @listfile ...]\n",
+	    getprogname());
 	exit(1);
 }
 
+static const struct option longopts[] = {
+	{ "client",	required_argument,	NULL,	OPT_CLIENT },
+	{ "io-uring",	no_argument,		NULL,	OPT_URING },
+	{ "nops",	required_argument,	NULL,	OPT_NOPS },
+	{ "perf-counters", no_argument,		NULL,	OPT_PERF },
+	{ "readahead",	required_argument,	NULL,	OPT_READAHEAD },
+	{ "serve",	required_argument,	NULL,	OPT_SERVE },
+	{ "stats",	optional_argument,	NULL,	OPT_STATS },
+	{ "trace",	required_argument,	NULL,	OPT_TRACE },
+	{ NULL,		0,			NULL,	0 }
+};
+
 int
 main(int argc, char **argv)
 {
+	static struct jobslots slots;	/* used by jobslots_exit() */
+	struct pathlist paths;
+	struct objctx proto;
+	struct cache *cache;
+	struct objctx *objs, *batch[URING_BATCH];
+	struct uring *ring;
+	const struct nop_style *nops;
+	const char *cachedir, *clientsock, *servesock, *tracepath;
+	char *end;
+	uint64_t cachesize, start;
+	u_long njobs, readahead;
+	size_t nbatch;
+	int ch, perffds[NCOUNTERS], ret;
+	bool atomic, doperf, dostats, jobserver, keeptimes, perobj, readstdin;
+	bool setjobs, uselibelf, useuring, verbose;
 
-	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
-		g_verbose = true;
-		argv++; argc--;
+	/*
+	 * Check the descriptors passed by make before opening anything, so that
+	 * a descriptor which make did not pass cannot be mistaken for one of
+	 * ours.
+	 */
+	jobserver = jobserver_open(&slots);
+
+	memset(&paths, 0, sizeof(paths));
+	cache = NULL;
+	cachedir = clientsock = servesock = tracepath = NULL;
+	cachesize = CACHE_DEFAULT_SIZE;
+	njobs = 1;
+	readahead = 0;
+	nops = &nop_styles[0];
+	atomic = doperf = dostats = keeptimes = perobj = readstdin = false;
+	setjobs = uselibelf = useuring = verbose = false;
+	while ((ch = getopt_long(argc, argv, "0C:LM:ST:j:pv", longopts,
+	    NULL)) != -1) {
+		switch (ch) {
+		case '0':
+			readstdin = true;
+			break;
+		case 'C':
+			cachedir = optarg;
+			break;
+		case 'L':
+			uselibelf = true;
+			break;
+		case 'M':
+			if (expand_number(optarg, &cachesize) != 0 ||
+			    cachesize == 0)
+				errx(1, "invalid cache size '%s'", optarg);
+			break;
+		case 'S':
+			atomic = true;
+			break;
+		case 'T':
+			pathlist_read(&paths, optarg, '\n');
+			break;
+		case 'j':
+			errno = 0;
+			njobs = strtoul(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || njobs > UINT_MAX)
+				errx(1, "invalid job count '%s'", optarg);
+			if (njobs == 0) {
+				/* Use one worker per online CPU. */
+				njobs = online_cpus();
+			}
+			setjobs = true;
+			break;
+		case 'p':
+			keeptimes = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case OPT_CLIENT:
+			clientsock = optarg;
+			break;
+		case OPT_NOPS:
+			nops = NULL;
+			for (size_t i = 0; i < nitems(nop_styles); i++)
+				if (strcmp(optarg, nop_styles[i].name) == 0)
+					nops = &nop_styles[i];
+			if (nops == NULL)
+				errx(1, "invalid NOP type '%s'", optarg);
+			break;
+		case OPT_PERF:
+			doperf = dostats = true;
+			break;
+		case OPT_READAHEAD:
+			errno = 0;
+			readahead = strtoul(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || readahead > UINT_MAX)
+				errx(1, "invalid read-ahead count '%s'", optarg);
+			break;
+		case OPT_SERVE:
+			servesock = optarg;
+			break;
+		case OPT_STATS:
+			dostats = true;
+			if (optarg == NULL)
+				break;
+			if (strcmp(optarg, "objects") != 0)
+				errx(1, "invalid statistics mode '%s'", optarg);
+			perobj = true;
+			break;
+		case OPT_TRACE:
+			tracepath = optarg;
+			break;
+		case OPT_URING:
+			useuring = true;
+			break;
+		default:
+			usage();
+		}
 	}
-
-	if (argc <= 1)
+	argc -= optind;
+	argv += optind;
+
+	if (readstdin)
+		pathlist_read(&paths, "-", '\0');
+	for (int i = 0; i < argc; i++) {
+		if (argv[i][0] == '@')
+			pathlist_read(&paths, argv[i] + 1, '\n');
+		else
+			pathlist_add(&paths, argv[i]);
+	}
+	if (servesock != NULL ?
+	    clientsock != NULL || tracepath != NULL || paths.count > 0 :
+	    paths.count < 1)
 		usage();
 
+	if (clientsock != NULL) {
+		ret = client(clientsock, &paths);
+		pathlist_free(&paths);
+		return (ret);
+	}
+
 	if (elf_version(EV_CURRENT) == EV_NONE)
 		errx(1, "ELF library too old");
 
-	for (int i = 1; i < argc; i++)
-		process_obj(argv[i]);
+	if (cachedir != NULL)
+		cache = cache_open(cachedir, cachesize);
 
-	return (0);
+	if (doperf) {
+		if (perf_open(perffds) != 0) {
+			warn("hardware counters unavailable, reporting times only");
+			doperf = false;
+		} else
+			perf_close(perffds);
+	}
+
+	if (useuring) {
+		if ((ring = uring_open(URING_ENTRIES)) == NULL) {
+			warn("io_uring unavailable, using regular I/O");
+			useuring = false;
+		} else
+			uring_close(ring);
+	}
+
+	memset(&proto, 0, sizeof(proto));
+	proto.verbose = verbose;
+	proto.uselibelf = uselibelf;
+	proto.atomic = atomic;
+	proto.keeptimes = keeptimes;
+	proto.nops = nops;
+	proto.readahead = readahead;
+	proto.useuring = useuring;
+
+	/*
+	 * Under a parallel make, use up to one thread per CPU by default, as
+	 * long as the jobserver hands out tokens for them.
+	 */
+	if (jobserver && !setjobs)
+		njobs = online_cpus();
+	if (njobs > 1) {
+		if ((ret = pthread_mutex_init(&slots.lock, NULL)) != 0)
+			errc(1, ret, "pthread_mutex_init");
+		slots.avail = njobs - 1;
+		slots.tokens = xmalloc(slots.avail);
+		slots.ntokens = 0;
+		proto.slots = &slots;
+		exitslots = &slots;
+		if (atexit(jobslots_exit) != 0)
+			err(1, "atexit");
+	}
+	proto.cache = cache;
+	proto.dostats = dostats || tracepath != NULL;
+	proto.doperf = doperf;
+	for (int i = 0; i < NCOUNTERS; i++)
+		proto.perffds[i] = -1;
+	proto.fd = proto.outfd = -1;
+
+	if (servesock != NULL)
+		serve(servesock, &proto, njobs, perobj);
+
+	objs = xmalloc(paths.count * sizeof(*objs));
+	for (size_t i = 0; i < paths.count; i++) {
+		objs[i] = proto;
+		objs[i].path = paths.paths[i];
+	}
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	if (njobs == 1 || paths.count == 1) {
+		njobs = 0;
+		ring = useuring ? uring_open(URING_ENTRIES) : NULL;
+		nbatch = uring_batch(1);
+		for (size_t i = 0, ra = 1; i < paths.count; i++) {
+			for (; ra < paths.count && ra <= i + readahead; ra++)
+				obj_readahead(objs[ra].path);
+			if (ring != NULL && i % nbatch == 0) {
+				for (size_t j = 0; j < nbatch &&
+				    i + j < paths.count; j++)
+					batch[j] = &objs[i + j];
+				uring_prefilter(ring, batch,
+				    MIN(nbatch, paths.count - i));
+			}
+			objs[i].ring = ring;
+			process_obj(&objs[i]);
+			objs[i].ring = NULL;
+		}
+		uring_close(ring);
+	} else {
+		/*
+		 * An error in one object must not kill the other workers
+		 * partway through writing theirs, so errors are reported along
+		 * with the other diagnostics, and the exit status set once all
+		 * objects have been processed.
+		 */
+		for (size_t i = 0; i < paths.count; i++)
+			objs[i].recover = true;
+		run_workers(objs, paths.count, njobs, diag_flush, NULL);
+	}
+	ret = 0;
+	for (size_t i = 0; i < paths.count; i++)
+		if (objs[i].failed)
+			ret = 1;
+	if (dostats)
+		stats_report(objs, paths.count, perobj);
+	if (tracepath != NULL)
+		trace_write(tracepath, start, objs, paths.count,
+		    MIN(njobs, paths.count));
+	free(objs);
+	pathlist_free(&paths);
+
+	if (cache != NULL) {
+		cache_trim(cache);
+		cache_report(cache);
+	}
+
+	return (ret);
 }